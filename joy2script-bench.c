@@ -0,0 +1,455 @@
+/*
+   joy2script-bench - drives joy2script with synthetic joystick events
+   through a FIFO, with no joystick needed, and measures how long events
+   take to turn into actions.  Run by "make bench".
+
+   Every scenario is run once per way of carrying out an action:
+
+     sink         @fifo: action, written by joy2script itself; the
+                  baseline cost of joy2script with a no-op action
+     worker pool  a shell command run by the persistent shells
+     shell        the same command with -workers 0, a new /bin/sh for
+                  every action as system() used to do
+
+   and every action writes a line back to a FIFO we read, so the time
+   from writing an event to reading its line is the latency.  The release
+   scenario is a check rather than a measure: if a smoothed stick let go
+   near the centre doesn't turn off, the bench exits non-zero.
+
+   This is free software under the GNU General Public License (GPL v2).
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <linux/joystick.h>
+
+#define SWEEP_EVENTS        1000
+#define SWEEP_PERIOD_NS     2000000ULL
+#define STORM_PRESSES       2000
+#define STORM_BUTTONS       12
+#define REPEAT_BUTTONS      8
+#define REPEAT_RATE_MS      10
+#define REPEAT_HOLD_NS      2000000000ULL
+#define IDLE_TIMEOUT_MS     1000
+#define STARTUP_NS          5000000000ULL
+#define MAX_SAMPLES         (SWEEP_EVENTS + STORM_PRESSES + \
+                             REPEAT_BUTTONS * 1000)
+
+typedef enum {PATH_SINK, PATH_POOL, PATH_SHELL} path_type;
+
+const char *path_names[] = {"sink", "worker pool", "shell"};
+
+extern char **environ;
+
+char *joy2script;
+char dir[] = "/tmp/joy2script-bench.XXXXXX";
+char dev_path[64], out_path[64], config_path[64];
+int out_fd;
+pid_t daemon_pid;
+
+/* Lines read back from the actions: what the action wrote and when */
+struct s_result {
+    unsigned long long time;
+    char tag;
+    int number, value;
+} results[MAX_SAMPLES];
+int num_results;
+
+char line_buffer[4096];
+int line_len;
+
+unsigned long long monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int compare_ull(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* The action for a binding: key = an action that writes "tag number %v"
+ * to out_path */
+void write_action(FILE *config, path_type path, const char *key, char tag,
+        int number)
+{
+    if (path == PATH_SINK)
+        fprintf(config, "%s = @fifo:%s %c %d %%v\n", key, out_path, tag,
+                number);
+    else
+        fprintf(config, "%s = echo %c %d %%v > %s\n", key, tag, number,
+                out_path);
+}
+
+/* Take in whatever the actions have written, waiting up to timeout ms
+ * for the first of it.  A line is timed by the read that brought it in,
+ * not by the first read of the batch.  Returns the number of lines
+ * read. */
+int read_results(int timeout)
+{
+    struct pollfd pfd = {out_fd, POLLIN, 0};
+    unsigned long long now;
+    char *start, *end;
+    int n, count = 0;
+
+    if (poll(&pfd, 1, timeout) <= 0)
+        return 0;
+
+    while ((n = read(out_fd, line_buffer + line_len,
+                    sizeof(line_buffer) - line_len - 1)) > 0)
+    {
+        now = monotonic_ns();
+        line_len += n;
+        line_buffer[line_len] = '\0';
+
+        start = line_buffer;
+        while ((end = strchr(start, '\n')))
+        {
+            struct s_result *result = &results[num_results];
+
+            if (num_results < MAX_SAMPLES && sscanf(start, "%c %d %d",
+                        &result->tag, &result->number, &result->value) == 3)
+            {
+                result->time = now;
+                num_results++;
+                count++;
+            }
+            start = end + 1;
+        }
+        line_len -= start - line_buffer;
+        memmove(line_buffer, start, line_len);
+    }
+    return count;
+}
+
+/* Start joy2script on config_path and connect to its device FIFO.
+ * Returns the fd to write events to, or -1. */
+int daemon_start(path_type path)
+{
+    posix_spawn_file_actions_t actions;
+    /* No cache: it would be left behind in dir */
+    char *argv[] = {joy2script, "-config", config_path, "-no-cache",
+        "-dev", dev_path, "--no-daemon", "-workers",
+        path == PATH_SHELL ? "0" : "2", NULL};
+    unsigned long long deadline = monotonic_ns() + STARTUP_NS;
+    int fd;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+            O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null",
+            O_WRONLY, 0);
+    if (posix_spawn(&daemon_pid, joy2script, &actions, NULL, argv, environ))
+    {
+        perror(joy2script);
+        return -1;
+    }
+    posix_spawn_file_actions_destroy(&actions);
+
+    /* ENXIO until joy2script opens its end */
+    while ((fd = open(dev_path, O_WRONLY | O_NONBLOCK)) == -1)
+    {
+        if (errno != ENXIO || monotonic_ns() > deadline ||
+                waitpid(daemon_pid, NULL, WNOHANG) == daemon_pid)
+        {
+            fprintf(stderr, "joy2script didn't open %s\n", dev_path);
+            return -1;
+        }
+        usleep(10000);
+    }
+    fcntl(fd, F_SETFL, 0);
+
+    /* Let it finish starting up: the workers come after the devices */
+    usleep(300000);
+    read_results(0);
+    num_results = 0;
+    return fd;
+}
+
+void daemon_stop(int fd)
+{
+    close(fd);
+    kill(daemon_pid, SIGTERM);
+    waitpid(daemon_pid, NULL, 0);
+    while (read_results(100))
+        ;
+}
+
+void send_event(int fd, int type, int number, int value)
+{
+    struct js_event js = {0, value, type, number};
+
+    if (write(fd, &js, sizeof(js)) != sizeof(js))
+        perror("write");
+}
+
+void report_latency(unsigned long long *samples, int count)
+{
+    qsort(samples, count, sizeof(*samples), compare_ull);
+    printf("  latency p50 %6llu us  p99 %6llu us  p99.9 %6llu us",
+            samples[count * 50 / 100] / 1000,
+            samples[count * 99 / 100] / 1000,
+            samples[count * 999 / 1000] / 1000);
+}
+
+/* Move one axis through a new position every SWEEP_PERIOD_NS, each
+ * position giving an action that reports it */
+void run_sweep(path_type path)
+{
+    static unsigned long long sent_at[SWEEP_EVENTS + 2];
+    unsigned long long samples[SWEEP_EVENTS];
+    unsigned long long next, now;
+    FILE *config = fopen(config_path, "w");
+    int fd, sent = 0, count = 0, i, timeout;
+
+    /* Every new value fires; %v is the raw value */
+    fprintf(config, "[axis 0]\ndeadzone = 1\ndeadzone_size = 0\n"
+            "repeat = 1\noutput_low = 0\noutput_high = 32768\n");
+    write_action(config, path, "action_on", 'a', 0);
+    fclose(config);
+
+    if ((fd = daemon_start(path)) == -1)
+        return;
+
+    next = monotonic_ns();
+    while (sent < SWEEP_EVENTS)
+    {
+        now = monotonic_ns();
+        if (now >= next)
+        {
+            /* Values start at 2, as 1 is the deadzone */
+            sent_at[sent + 2] = monotonic_ns();
+            send_event(fd, JS_EVENT_AXIS, 0, sent + 2);
+            sent++;
+            next += SWEEP_PERIOD_NS;
+            continue;
+        }
+        timeout = (next - now) / 1000000;
+        read_results(timeout);
+    }
+    while (read_results(IDLE_TIMEOUT_MS))
+        ;
+    daemon_stop(fd);
+
+    for (i = 0; i < num_results; i++)
+    {
+        if (results[i].tag == 'a' && results[i].value >= 2 &&
+                results[i].value < sent + 2)
+            samples[count++] = results[i].time - sent_at[results[i].value];
+    }
+
+    /* The rate is the pace we set, not a measure: see the storm */
+    printf("sweep    %-12s %5d sent %5d done", path_names[path], sent, count);
+    if (count)
+        report_latency(samples, count);
+    printf("  %7.0f ev/s offered\n", 1e9 / SWEEP_PERIOD_NS);
+}
+
+/* Press and release buttons as fast as the FIFO takes them.  Presses
+ * joy2script drops or merges when it falls behind give no line, and are
+ * reported apart from the ones that ran. */
+void run_storm(path_type path)
+{
+    FILE *config = fopen(config_path, "w");
+    unsigned long long start, last = 0;
+    int fd, i, count = 0;
+
+    for (i = 0; i < STORM_BUTTONS; i++)
+    {
+        fprintf(config, "[button %d]\n", i);
+        write_action(config, path, "action_on", 'b', i);
+    }
+    fclose(config);
+
+    if ((fd = daemon_start(path)) == -1)
+        return;
+
+    start = monotonic_ns();
+    for (i = 0; i < STORM_PRESSES; i++)
+    {
+        send_event(fd, JS_EVENT_BUTTON, i % STORM_BUTTONS, 1);
+        send_event(fd, JS_EVENT_BUTTON, i % STORM_BUTTONS, 0);
+        read_results(0);
+    }
+    while (read_results(IDLE_TIMEOUT_MS))
+        ;
+    daemon_stop(fd);
+
+    for (i = 0; i < num_results; i++)
+    {
+        if (results[i].tag == 'b' && results[i].number >= 0 &&
+                results[i].number < STORM_BUTTONS)
+        {
+            count++;
+            last = results[i].time;
+        }
+    }
+
+    printf("storm    %-12s %5d sent %5d done %5d dropped", path_names[path],
+            STORM_PRESSES, count, STORM_PRESSES - count);
+    printf("  %7.0f ev/s\n", count ? count * 1e9 / (last - start) : 0);
+}
+
+/* Hold buttons with a repeat rate and see how evenly the repeats come */
+void run_repeats(path_type path)
+{
+    static unsigned long long samples[MAX_SAMPLES];
+    unsigned long long last[REPEAT_BUTTONS] = {0};
+    unsigned long long interval, expected = REPEAT_RATE_MS * 1000000ULL;
+    unsigned long long total = 0, end;
+    FILE *config = fopen(config_path, "w");
+    int fd, i, b, count = 0;
+
+    for (i = 0; i < REPEAT_BUTTONS; i++)
+    {
+        fprintf(config, "[button %d]\nrepeat_rate = %d\n", i,
+                REPEAT_RATE_MS);
+        write_action(config, path, "action_on", 'r', i);
+    }
+    fclose(config);
+
+    if ((fd = daemon_start(path)) == -1)
+        return;
+
+    for (i = 0; i < REPEAT_BUTTONS; i++)
+        send_event(fd, JS_EVENT_BUTTON, i, 1);
+    end = monotonic_ns() + REPEAT_HOLD_NS;
+    while (monotonic_ns() < end)
+        read_results(10);
+    for (i = 0; i < REPEAT_BUTTONS; i++)
+        send_event(fd, JS_EVENT_BUTTON, i, 0);
+    daemon_stop(fd);
+
+    for (i = 0; i < num_results; i++)
+    {
+        b = results[i].number;
+        if (results[i].tag != 'r' || b < 0 || b >= REPEAT_BUTTONS)
+            continue;
+        if (last[b])
+        {
+            interval = results[i].time - last[b];
+            total += interval;
+            samples[count++] = interval > expected ?
+                interval - expected : expected - interval;
+        }
+        last[b] = results[i].time;
+    }
+
+    printf("repeats  %-12s %5d held %5d done", path_names[path],
+            REPEAT_BUTTONS, num_results);
+    if (count)
+    {
+        qsort(samples, count, sizeof(*samples), compare_ull);
+        printf("  interval %5.2f ms  jitter p50 %5llu us  p99 %6llu us"
+                "  max %6llu us", total / 1e6 / count,
+                samples[count * 50 / 100] / 1000,
+                samples[count * 99 / 100] / 1000,
+                samples[count - 1] / 1000);
+    }
+    printf("\n");
+}
+
+/* Let go of a smoothed stick that comes to rest just off the centre,
+ * with nothing after it to move the average on: it must still turn off,
+ * and stop repeating.  Returns 0 if it did. */
+int run_release(path_type path)
+{
+    static const int positions[] = {32767, 20000, 8000, 200};
+    FILE *config = fopen(config_path, "w");
+    int fd, i, off = -1, late = 0;
+
+    fprintf(config, "[axis 0]\nsmoothing = 50\ndeadzone = 2000\n"
+            "repeat = 1\n");
+    write_action(config, path, "action_on", 'a', 0);
+    write_action(config, path, "action_off", 'o', 0);
+    fclose(config);
+
+    if ((fd = daemon_start(path)) == -1)
+        return -1;
+
+    for (i = 0; i < sizeof(positions) / sizeof(positions[0]); i++)
+    {
+        send_event(fd, JS_EVENT_AXIS, 0, positions[i]);
+        read_results(20);
+    }
+    while (read_results(IDLE_TIMEOUT_MS / 4))
+        ;
+    daemon_stop(fd);
+
+    for (i = 0; i < num_results; i++)
+    {
+        if (results[i].tag == 'o')
+            off = i;
+        else if (results[i].tag == 'a' && off != -1)
+            late++;
+    }
+
+    printf("release  %-12s %s", path_names[path],
+            off == -1 ? "FAILED: never turned off" :
+            late ? "FAILED: repeated after turning off" : "ok");
+    printf("\n");
+    return off == -1 || late ? -1 : 0;
+}
+
+void cleanup()
+{
+    unlink(dev_path);
+    unlink(out_path);
+    unlink(config_path);
+    rmdir(dir);
+}
+
+int main(int argc, char **argv)
+{
+    path_type path;
+    int failed = 0;
+
+    joy2script = argc > 1 ? argv[1] : "./joy2script";
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!mkdtemp(dir))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(dev_path, sizeof(dev_path), "%s/js", dir);
+    snprintf(out_path, sizeof(out_path), "%s/out", dir);
+    snprintf(config_path, sizeof(config_path), "%s/rc", dir);
+    atexit(cleanup);
+
+    /* Held open for writing too, so it never reads as closed between
+     * one action and the next */
+    if (mkfifo(dev_path, 0600) || mkfifo(out_path, 0600) ||
+            (out_fd = open(out_path, O_RDWR | O_NONBLOCK)) == -1)
+    {
+        perror(dir);
+        return 1;
+    }
+
+    printf("joy2script-bench: %s\n", joy2script);
+    for (path = PATH_SINK; path <= PATH_SHELL; path++)
+    {
+        run_sweep(path);
+        run_storm(path);
+        run_repeats(path);
+        if (run_release(path))
+            failed = 1;
+    }
+    return failed;
+}
@@ -14,18 +14,46 @@
 
 */
 
+#define _GNU_SOURCE
 #include "config.h"
 
 #define JOY2SCRIPT_VERSION                "2.0"
 
 #define MAX_ACTION_STRING              1024 
+#define MAX_ACTION_ARGS                64
 #define DEFAULT_AUTOREPEAT             5
 #define DEFAULT_DEADZONE               100
 #define DEFAULT_DEADZONE_SIZE               50
-#define DEFAULT_DEVICE                 "/dev/input/js0"
+#define DEFAULT_DEVICE                 "/dev/input/js*"
+#define DEFAULT_EVDEV_DEVICE           "/dev/input/event*"
+#define MAX_DEVICES                    16
+#define MAX_DEVICE_NAME                128
 #define DEFAULT_CONFIG_FILE            ".joy2scriptrc" /* located in $(HOME) */
 #define EMAIL                          "brianh32@gmail.com"
 #define MAX_MODES		       16
+#define MAX_CONTROLS                   256
+#define MASK_WORDS                     (MAX_CONTROLS / 64)
+#define MAX_SEQUENCE                   16
+#define DEFAULT_SEQUENCE_TIMEOUT       500
+#define MAX_CURVE_POINTS               16
+#define SINK_RETRY_NS                  1000000000ULL
+#define CURVE_SIZE                     65536
+#define ARENA_CHUNK                    4096
+#define DEFAULT_WORKERS                2
+#define MAX_WORKERS                    64
+#define DEFAULT_MAX_CHILDREN           32
+#define DEFAULT_MAX_QUEUED             4096
+#define DEFAULT_RT_PRIORITY            50
+#define DEFAULT_CATCHUP                16
+#define JS_EVENT_BATCH                 64
+#define DEFAULT_RING_SIZE              4096
+#define READER_STACK                   65536
+#define MAX_EPOLL_EVENTS               32
+#define STREAM_BUFFER                  65536
+#define MAX_SUBSCRIBERS                16
+#define LOG_MAGIC                      "j2slog1\n"
+#define HIST_SUB_BITS                  3
+#define HIST_BUCKETS                   (64 << HIST_SUB_BITS)
 
 #define DEBUG 0
 
@@ -38,22 +66,279 @@
 #include <ctype.h>
 #include <syslog.h>
 #include <string.h>
+#include <math.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/timerfd.h>
 #include <sys/time.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <glob.h>
+#include <fnmatch.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <errno.h>
 #include <linux/joystick.h>
+#include <linux/input.h>
 
-int jsfd=-1;
-char numaxes, numbuttons;
-int current_mode=0;
+/* Anything that needs /bin/sh to mean what it says */
+#define SHELL_METACHARS                "|&;<>()$`\\\"'*?[]{}#~=!\n"
+
+extern char **environ;
+
+int epfd=-1;
+int timer_fd=-1;
+
+struct s_timer **timer_heap;
+int timer_count, timer_capacity;
+unsigned long long timer_armed;
 int daemonize = 1;
+int daemonized;     /* stdout and stderr are gone; report to syslog */
+int num_workers = DEFAULT_WORKERS;
+int max_children = DEFAULT_MAX_CHILDREN;
+int max_queued = DEFAULT_MAX_QUEUED;
+int bench_exec = 0;
+int use_cache = 1;
 
-struct s_axis {
-    char *action_on;
-    char *action_off;
+/* Real-time options: a SCHED_FIFO priority (0 leaves the scheduler
+ * alone), a CPU to pin to (-1 is any), whether to lock memory, and how
+ * many wakeups -rt-test measures.  cpus is the affinity we started with,
+ * which the workers go back to. */
+int rt_priority = 0;
+int rt_cpu = -1;
+int rt_lock_memory = 0;
+int rt_test = 0;
+cpu_set_t rt_original_cpus;
+
+/* Action strings are compiled once into a list of segments: literal
+ * text, or a slot for %v (the scaled value), %s (the sign) or %n (the
+ * repeats a firing stands for).  max_len is the longest the expansion
+ * can be, so it is checked against the buffer once rather than on every
+ * character. */
+typedef enum {SEGMENT_LITERAL, SEGMENT_VALUE, SEGMENT_SIGN,
+    SEGMENT_COUNT} segment_type;
+
+struct s_segment {
+    segment_type type;
+    const char *text;
+    int len;
+};
+
+struct s_template {
+    struct s_segment *segments;
+    int num_segments;
+    int max_len;
+};
+
+/* Actions starting with '@' are handled by joy2script itself rather
+ * than run as a command */
+typedef enum {BUILTIN_NONE, BUILTIN_MODE, BUILTIN_SINK} builtin_type;
+
+/* Somewhere @unix:, @fifo: and @fd: actions write their message to.
+ * Sinks are opened on first use and kept open; one that fails is closed
+ * and not tried again for SINK_RETRY_NS, messages meanwhile are
+ * dropped.  Actions with the same target share a sink. */
+typedef enum {SINK_UNIX, SINK_FIFO, SINK_FD} sink_type;
+
+struct s_sink {
+    sink_type type;
+    const char *target;     /* interned path, or the fd number */
+    int fd;
+    int is_socket;          /* an inherited socket, written with send() */
+    unsigned long long retry_at;
+    int failed;             /* already reported as unavailable */
+    unsigned long sent, dropped;
+    /* The end of a line a stream socket only took part of.  It goes
+     * before anything else, so the reader still gets whole lines. */
+    char *pending;
+    int pending_len;
+    struct s_sink *next;
+} *sinks;
+
+/* -stream: every event, after the deadzone and asymmetric handling, is
+ * also published to stdout or to whoever connects to -stream-socket.
+ * Records are gathered in buffer and written once per batch of input;
+ * a subscriber that can't take a whole batch without blocking is
+ * dropped.  In binary format each event is one s_stream_record. */
+typedef enum {STREAM_NONE, STREAM_JSON, STREAM_BINARY} stream_format;
+
+#define STREAM_ATTACH   0x10
+#define STREAM_DETACH   0x20
+
+struct s_stream_record {
+    uint64_t time;      /* CLOCK_MONOTONIC ns */
+    uint8_t device;
+    uint8_t type;       /* JS_EVENT_AXIS, JS_EVENT_BUTTON or STREAM_* */
+    uint8_t number;
+    uint8_t on;         /* axis is outside the deadzone, button pressed */
+    int32_t value;      /* 0 inside the deadzone */
+};
+
+struct s_stream {
+    stream_format format;
+    char *path;
+    int listen_fd;
+    int subscribers[MAX_SUBSCRIBERS];
+    int num_subscribers;
+    unsigned long dropped;
+    char buffer[STREAM_BUFFER];
+    int len;
+} stream = {.listen_fd = -1};
+
+/* -record writes every batch of events read from the devices to a log,
+ * which -replay feeds back through dispatch_events() with no hardware.
+ * The log is LOG_MAGIC followed by s_log_records; an attach record is
+ * followed by len bytes holding the device's path and name, each NUL
+ * terminated. */
+#define LOG_ATTACH      0x10
+#define LOG_DETACH      0x20
+
+struct s_log_record {
+    uint64_t time;      /* ns since recording started */
+    uint8_t device;     /* s_device log_id */
+    uint8_t type;       /* JS_EVENT_AXIS, JS_EVENT_BUTTON or LOG_* */
+    uint8_t number;     /* attach: number of axes */
+    uint8_t extra;      /* attach: number of buttons; event: last in batch */
+    int16_t value;
+    uint16_t len;
+};
+
+char *record_path;
+FILE *record_file;
+unsigned long long record_start;
+/* Device ids grow with every attach, so the log numbers devices on its
+ * own: the lowest number no attached device has, freed on detach */
+unsigned char record_ids_used[256];
+char *replay_path;
+double replay_speed = 1;    /* 0 is as fast as possible */
+int replaying;
+
+/* What happened to an action, for the stats.  sent counts the times
+ * its binding fired, launched the times it was actually started or
+ * written to its sink.  overruns are repeats that came too late,
+ * however the binding's overrun setting then made up for them. */
+struct s_action_stats {
+    unsigned long sent, launched, dropped, failed, overruns;
+};
+
+/* Time taken by each stage from an event to the end of its action.
+ * Values are bucketed HDR style: exact below 2^HIST_SUB_BITS ns, then
+ * 2^HIST_SUB_BITS buckets per power of two, so any value is within
+ * 12.5% of its bucket.  Recording is an add, no locks or allocation. */
+typedef enum {HIST_INPUT, HIST_TIMER, HIST_EXPAND, HIST_LAUNCH,
+    HIST_LATENCY, HIST_RUN, NUM_HISTOGRAMS} histogram_type;
+
+struct s_histogram {
+    const char *name;
+    unsigned long long count, max;
+    unsigned long long buckets[HIST_BUCKETS];
+} histograms[NUM_HISTOGRAMS] = {
+    {.name = "input"},            /* event timestamp -> dispatch */
+    {.name = "timer late"},       /* repeat deadline -> run */
+    {.name = "expand"},           /* %v/%s substitution */
+    {.name = "launch"},           /* spawn, worker or sink write */
+    {.name = "event to launch"},  /* event or deadline -> started */
+    {.name = "run"},              /* started -> exited */
+};
+
+/* When the event or repeat being handled happened, and how many repeats
+ * the action being sent stands for (%n) */
+unsigned long long action_origin;
+int action_ticks = 1;
+int action_repeat;      /* it is a repeat, not an edge */
+
+/* Repeats started, missed because they came too late, and missed but
+ * fired anyway by overrun = catchup */
+unsigned long repeats_fired, repeats_missed, repeats_caught_up;
+unsigned long long stats_start;
+char *control_path;
+int control_fd = -1;
+
+/* An action as written in the config.  argv is filled in at config time
+ * when the command is a plain word list, so it can be spawned directly
+ * without a shell; it is NULL when the command needs /bin/sh.  Each word
+ * of argv and the whole command have their own template. */
+struct s_action {
+    const char *command;
+    char **argv;
+    struct s_template template;
+    struct s_template *argv_templates;
+    int running;    /* copies of this action that haven't finished */
+    int queued;     /* copies waiting in the executor queue */
+    int drop_logged;    /* a drop has been reported */
+    builtin_type builtin;
+    int mode;       /* @mode N: the mode to switch to */
+    int mode_step;  /* @mode next/prev: +1 or -1, mode is unused */
+    struct s_sink *sink;    /* template is the message written to it */
+    struct s_action_stats stats;
+};
+
+/* Everything registered with epoll carries one of these in its event
+ * data, so a ready fd leads straight to its handler and owner */
+typedef enum {WATCH_RING, WATCH_READER, WATCH_TIMERS, WATCH_HOTPLUG,
+    WATCH_WORKER, WATCH_SIGNALS, WATCH_STREAM, WATCH_CONTROL} watch_type;
+
+struct s_watch {
+    watch_type type;
+    void *owner;
+};
+
+/* A repeat schedule, kept in a binary min-heap ordered by deadline that
+ * drives the single timer_fd.  A TIMER_FLUSH fires once, its interval
+ * is unused.  heap_index is the 1-based slot in the
+ * heap, 0 while the timer isn't scheduled, so zeroed tables start out
+ * idle.  Times are CLOCK_MONOTONIC nanoseconds. */
+typedef enum {TIMER_AXIS, TIMER_BUTTON, TIMER_FLUSH} timer_type;
+
+struct s_timer {
+    unsigned long long deadline;
+    unsigned long long interval;
+    int heap_index;
+    timer_type type;
+    void *owner;
+};
+
+/* A response curve takes how far the axis is pushed, 0 to 1, to how far
+ * to go between output_low and output_high (or between the repeat
+ * rates), also 0 to 1.  Points are in percent. */
+typedef enum {CURVE_LINEAR, CURVE_LOG, CURVE_EXP, CURVE_POWER,
+    CURVE_POINTS} curve_type;
+
+struct s_curve {
+    curve_type type;
+    double power;
+    int num_points;
+    short x[MAX_CURVE_POINTS];
+    short y[MAX_CURVE_POINTS];
+};
+
+/* A curve worked out for every axis value, indexed by the raw value
+ * from the driver + 32768.  Axes with the same settings share one. */
+struct s_curve_table {
+    struct s_curve curve;
+    int asymmetric, is_signed, low, high;
+    int *table;
+    struct s_curve_table *next;
+} *curve_tables;
+
+/* Settings of an axis binding, read only once the config is loaded */
+struct s_axis_config {
+    struct s_action *action_on;
+    struct s_action *action_off;
     int deadzone;
     int deadzone_size;
     int asymmetric;
@@ -62,96 +347,496 @@ struct s_axis {
     int repeat;
     int output_low;
     int output_high;
-    int time_to_repeat;
-    char on;
+    int max_running;
+    int smoothing;      /* percent of the previous value kept, 0 is off */
+    int min_delta;      /* smaller moves are dropped */
+    int max_rate;       /* updates per second, 0 is no limit */
+    int overrun;        /* what to do about missed repeats, OVERRUN_* */
+    int integrate;      /* ms between sums of %v over time, 0 is off */
+    struct s_curve curve;
+    const int *output_table;    /* %v */
+    const int *rate_table;      /* repeat interval in ms */
+};
+
+struct s_button_config {
+    struct s_action *action_on;
+    struct s_action *action_off;
+    int repeat_rate;
+    int max_running;
+    int overrun;
+};
+
+/* When repeats were missed: fire once and forget them, fire once with
+ * %n saying how many it stands for, or, for any value above 0, fire
+ * again for each missed one, up to that many */
+#define OVERRUN_SKIP                   0
+#define OVERRUN_COUNT                  (-1)
+
+/* What an axis or button is doing on one device in one mode.  Only
+ * this is touched per event; the settings are behind config.  passed is
+ * the last raw value the axis filter let through, smoothed its running
+ * average, and pending a value max_rate held back until flush.  With
+ * integrate, integral is %v times the nanoseconds it was held for,
+ * summed up to integrated_at and not yet sent. */
+struct s_axis {
+    const struct s_axis_config *config;
     int value;
-    int timer_fd;
-    struct itimerspec old_its;
+    char on;
+    struct s_timer timer;
+    int passed, smoothed, pending;
+    unsigned long long passed_at;
+    struct s_timer flush;
+    long long integral;
+    unsigned long long integrated_at;
 };
 
 struct s_button {
-    char *action_on;
-    char *action_off;
-    int repeat_rate; 
-    int time_to_repeat;
+    const struct s_button_config *config;
     char on;
-    int timer_fd;
+    struct s_timer timer;
+};
+
+/* A [chord] or [sequence] binding.  It has the settings of a button
+ * (but no repeat), and a sequence has timeout: the most ms allowed
+ * between its presses.  A chord fires action_on when exactly its
+ * buttons are held, and action_off when one of them is let go. */
+struct s_combo {
+    struct s_button_config config;
+    int timeout;
+    uint64_t mask[MASK_WORDS];  /* chord: its buttons */
+    unsigned char *buttons;     /* sequence: its presses in order */
+    int length;                 /* 0 for a chord */
+    struct s_combo *next;
+    struct s_combo *next_hash;  /* chord: next in its chord_table bucket */
+};
+
+/* Every sequence of a mode compiled into one automaton: the state after
+ * each press is next[state * width + button], with the failure links
+ * already folded in, so a press costs one lookup however many sequences
+ * there are.  match is the sequence reaching a state completes;
+ * timeout is how long a state lasts before the next press must start
+ * again from state 0. */
+struct s_automaton {
+    int num_states, width;
+    short *next;
+    struct s_combo **match;
+    unsigned long long *timeout;
 };
 
+/* Bindings of one mode, sized to the highest axis and button used.
+ * Chords are found from the buttons held through chord_table, a hash
+ * table of chord_table_size (a power of two) buckets. */
 struct s_mode {
-    struct s_axis axis[256];
-    struct s_button button[256];
-} mode[MAX_MODES];
+    struct s_axis_config *axis;
+    struct s_button_config *button;
+    int num_axes, num_buttons;
+    struct s_combo *combos, **last_combo;
+    int num_combos;
+    struct s_combo **chord_table;
+    int chord_table_size;
+    struct s_automaton sequences;
+};
+
+/* The bindings of one [device] section of the config, or of everything
+ * outside a section for default_profile.  match is compared with both
+ * the device path and the name the driver reports.  num_modes is one
+ * more than the highest mode defined. */
+struct s_profile {
+    const char *match;
+    struct s_mode mode[MAX_MODES];
+    int num_modes;
+    struct s_profile *next;
+};
+
+/* Everything read from one load of the config.  A reload parses into a
+ * new one and swaps it in whole between batches of events, so no event
+ * sees half of each; if the new config doesn't parse, the old one stays.
+ * Strings, curve tables and sinks are shared between loads. */
+struct s_bindings {
+    struct s_profile default_profile;
+    struct s_profile *profiles;
+} *bindings;
+
+/* Controls with no binding in a mode point here */
+const struct s_axis_config unbound_axis;
+const struct s_button_config unbound_button;
+
+/* Every string from the config is copied into the arena once: lookup
+ * is a hash table over the strings already stored, so identical
+ * commands share their text.  Chunks are never moved or freed. */
+struct s_arena_chunk {
+    struct s_arena_chunk *next;
+    size_t used, size;
+    char data[];
+};
+
+struct s_arena {
+    struct s_arena_chunk *chunks;
+    const char **table;
+    size_t table_size, count;
+    size_t bytes, saved;
+} strings;
+
+typedef enum {BACKEND_JS, BACKEND_EVDEV} backend_type;
+
+/* State for a device read through evdev.  Events are collected into
+ * frame until the SYN_REPORT that ends them, translated to js_events
+ * with the numbering joydev would have used, so the same config works
+ * with either backend. */
+struct s_evdev {
+    short axis_map[ABS_CNT];
+    short button_map[KEY_CNT - BTN_MISC];
+    int abs_min[ABS_CNT];
+    int abs_max[ABS_CNT];
+    unsigned char key_state[(KEY_CNT - BTN_MISC + 7) / 8];
+    struct js_event frame[JS_EVENT_BATCH];
+    int frame_len;
+    int dropped;
+};
 
-char *device=DEFAULT_DEVICE, 
+struct s_combo_state {
+    int state;                      /* in the mode's sequence automaton */
+    unsigned long long last_press;
+    const struct s_combo *chord;    /* the chord held, if any */
+};
+
+/* An attached joystick.  It has its own state for every control in
+ * every mode of its profile, numaxes (numbuttons) entries per mode, so
+ * held controls and repeats are tracked per device.  fd is
+ * -1 once the device has gone away; it is freed by devices_reap() after
+ * the current batch of epoll events, which may still point at it. */
+struct s_device {
+    char *path;
+    char name[MAX_DEVICE_NAME];
+    int id;             /* numbers devices in the event stream */
+    int log_id;         /* its device number in the -record log, or -1 */
+    int fd;
+    backend_type backend;
+    struct s_evdev *evdev;
+    /* When the events being dispatched happened (CLOCK_MONOTONIC ns):
+     * the kernel's timestamp with evdev, the time of the read with js.
+     * Repeats are scheduled from it, and lag tracks how late dispatch
+     * was. */
+    unsigned long long event_time;
+    unsigned long long lag_last, lag_max;
+    /* Axis events seen by the filter, and dropped by it for being too
+     * small a move or too soon after the last */
+    unsigned long axis_events, small_moves, too_soon;
+    unsigned char numaxes, numbuttons;
+    int current_mode, num_modes;
+    struct s_axis *axis;
+    struct s_button *button;
+    /* Buttons held, and per mode where the chords and sequences are */
+    const struct s_profile *profile;
+    uint64_t pressed[MASK_WORDS];
+    struct s_combo_state *combo;
+    struct s_device *next;
+} *devices;
+int next_device_id;
+
+/* The devices are read by a thread of their own that does nothing but
+ * copy what they send into this ring, stamped with the time it was
+ * read, so a slow action holds up dispatch but never the reading.  One
+ * writer and one reader: head is only moved by the reader thread and
+ * tail only by the main thread, each with a release store once the
+ * entries behind it are done with.  Events leave the last slot free, so
+ * there is always room to say some were dropped. */
+typedef enum {RING_EVENT, RING_GONE, RING_OVERFLOW} ring_entry_type;
+
+struct s_ring_entry {
+    int device;                 /* the device's id */
+    ring_entry_type type;
+    unsigned long long time;
+    union {
+        struct js_event js;
+        struct input_event ev;
+    };
+};
+
+struct s_ring {
+    struct s_ring_entry *entries;
+    unsigned int size;          /* a power of two */
+    /* The reader thread's side: the most entries ever queued at once,
+     * the events dropped for want of room, and whether it has said so
+     * since the last one that fitted */
+    unsigned int head __attribute__ ((aligned(64)));
+    unsigned int high_water;
+    unsigned long overflows;
+    int overflowing;
+    unsigned int tail __attribute__ ((aligned(64)));
+} ring;
+unsigned int ring_size = DEFAULT_RING_SIZE;
+
+/* The reader thread waits on reader_epfd for the devices, and for fds
+ * to close on reader_cmd: only it may close a device, as it could be
+ * reading it.  ring_fd wakes the main thread when there is something
+ * in the ring. */
+int reader_epfd = -1;
+int reader_cmd[2] = {-1, -1};
+#define READER_COMMAND                 (~0ULL)  /* no device's epoll data */
+int ring_fd = -1;
+pthread_t reader_thread;
+int reader_threaded;
+
+/* -dev paths, or DEFAULT_DEVICE if none were given */
+char *device_paths[MAX_DEVICES];
+int num_device_paths;
+backend_type backend = BACKEND_JS;
+
+/* inotify watches on the directories the devices live in */
+int hotplug_fd=-1;
+int hotplug_wd[MAX_DEVICES];
+char *hotplug_dirs[MAX_DEVICES];
+int num_hotplug_dirs;
+
+char
     *config_file=DEFAULT_CONFIG_FILE;
 
+/* The config file is watched through hotplug_fd for editors saving it */
+int config_wd = -1;
+char *config_name;
+
+/* A worker is a long-lived /bin/sh reading one command per line from
+ * cmd_fd.  After each command it writes a single byte to done_fd.  It
+ * is only given a command when idle, so a slow action never delays the
+ * ones behind it; action is what it is running while busy. */
+struct s_worker {
+    pid_t pid;
+    int cmd_fd;
+    int done_fd;
+    int busy;
+    unsigned long long start;
+    struct s_action *action;
+    struct s_watch watch;
+} workers[MAX_WORKERS];
+
+/* Actions started directly (posix_spawn) and still running, so the
+ * SIGCHLD reaper can tell which action a pid belonged to */
+struct s_job {
+    pid_t pid;
+    unsigned long long start;
+    struct s_action *action;
+} *jobs;
+
+int running_jobs;
+int signal_fd=-1;
+
+/* Actions over max_children or their binding's max_running, oldest
+ * first, with the %v, %s and %n they were sent with.  They start as
+ * running ones finish; only a full queue drops one. */
+struct s_queued {
+    struct s_action *action;
+    int limit, value, sign, ticks;
+    unsigned long long origin;
+} *queue;
+int num_queued;
+
 typedef enum {NONE, X, RAWCONSOLE, TERMINAL} target_type;
 typedef enum {PRESS, RELEASE} press_or_release_type;
 
 target_type target=NONE;
 
 void process_args(int argc, char **argv);
-void parse_config();
-int check_device(int argc, char **argv);
+struct s_bindings *parse_config();
+void bindings_free(struct s_bindings *b);
+void config_reload();
+struct s_device *device_attach(const char *path);
+struct s_device *device_add(struct s_device *dev);
+void device_detach(struct s_device *dev);
+void device_set_mode(struct s_device *dev, int mode);
+void device_rebind(struct s_device *dev, struct s_profile *profile);
+int device_builtin(struct s_device *dev, struct s_action *action);
+struct s_device *device_find(int id);
+int reader_init();
+int reader_start();
+void reader_poll(int timeout);
+int reader_add(struct s_device *dev);
+void ring_drain();
+void evdev_frames(struct s_device *dev, struct input_event *ev, int count);
+int evdev_setup(struct s_device *dev);
+void devices_scan();
+void devices_reap();
+int hotplug_init();
+void hotplug_event();
 void sendkey( unsigned int keycode, press_or_release_type PoR, int iscap);
 void cleanup(int s);
 void calibrate(int num);
-void send_axis_action(struct s_axis *axis, char *action);
-void repeat_event(fd_set *js_fdset);
-void axis_event(int number, int value);
-void button_event(int number, int value);
-int scale_value(int value, int max, int lower, int upper);
+void send_axis_action(struct s_axis *axis, struct s_action *action);
+void send_button_action(struct s_button *button, struct s_action *action,
+        int value);
+struct s_action *compile_action(const char *command, const char **error);
+const char *compile_builtin(struct s_action *action);
+void action_free(struct s_action *action);
+struct s_sink *sink_find(sink_type type, const char *target);
+int sink_open(struct s_sink *sink);
+int sink_open_fd(struct s_sink *sink);
+ssize_t sink_write(struct s_sink *sink, const char *buffer, size_t len);
+void sink_close(struct s_sink *sink);
+int sink_flush(struct s_sink *sink);
+void sinks_flush();
+int sink_send(struct s_action *action, int value, int sign);
+void action_too_long(const char *command);
+const char *intern(const char *text, size_t len);
+int stream_init();
+void stream_accept();
+void stream_event(struct s_device *dev, int type, int number);
+void stream_device(struct s_device *dev, int type);
+void stream_flush();
+int record_open(const char *path);
+void record_device(struct s_device *dev, int type);
+void record_events(struct s_device *dev, struct js_event *js, int count);
+int replay_run(const char *path);
+int watch_add(int fd, struct s_watch *watch, watch_type type, void *owner);
+unsigned long long monotonic_ns();
+void timer_schedule(struct s_timer *timer, timer_type type, void *owner,
+        unsigned long long deadline, unsigned long long interval);
+void timer_set_interval(struct s_timer *timer, timer_type type, void *owner,
+        unsigned long long interval, unsigned long long now);
+void timer_cancel(struct s_timer *timer);
+void timers_run();
+void timers_due(unsigned long long now);
+void timers_arm();
+void axis_event(struct s_device *dev, int number, int value);
+void axis_update(struct s_device *dev, struct s_axis *axis, int value);
+void axis_flush(struct s_device *dev, struct s_timer *timer);
+void axis_integrate(struct s_axis *axis, unsigned long long now);
+void axis_emit(struct s_axis *axis, int all);
+void button_event(struct s_device *dev, int number, int value);
+void combo_event(struct s_device *dev, int number, int value);
+void combos_build(struct s_bindings *b);
+void send_action(struct s_action *action, int value, int sign);
+unsigned int hash_string(const char *text, size_t len);
+void dispatch_events(struct s_device *dev, struct js_event *js, int count);
+int curve_index(const struct s_axis *axis);
+double curve_apply(const struct s_curve *curve, double t);
+int curve_equal(const struct s_curve *a, const struct s_curve *b);
+const int *curve_table(const struct s_curve *curve, int asymmetric,
+        int is_signed, int low, int high);
+int parse_curve(const char *text, struct s_curve *curve);
+int parse_overrun(const char *text, int *overrun);
+void curves_build(struct s_bindings *b);
 
 int check_config(int argc, char **argv);
 void make_daemon();
+void log_warning(const char *format, ...);
+
+void handle_events(int timeout);
+long long elapsed_us(struct timespec *start);
+int executor_init();
+int executor_admit(struct s_action *action, int limit, int value, int sign);
+int executor_run(struct s_action *action, const char *command);
+int executor_full(const struct s_action *action, int limit);
+void executor_drain();
+int executor_spawn(struct s_action *action, char **argv);
+void action_launched(struct s_action *action, unsigned long long start,
+        unsigned long long expanded);
+void worker_done(struct s_worker *worker);
+void children_reap();
+void executor_forget(struct s_action *action);
+void signals_read();
+int executor_benchmark(int count);
+void hist_record(histogram_type type, unsigned long long ns);
+void hist_add(struct s_histogram *h, unsigned long long ns);
+int realtime_init();
+int realtime_test(int count);
+void stats_report(FILE *out);
+void stats_log();
+int control_init();
+void control_accept();
 
 int main(int argc, char **argv)
 {
     int i;
-    struct js_event js;
-    fd_set js_fdset;
-    
+    struct s_watch timer_watch, hotplug_watch;
+
     puts("joy2script - reads joystick status and take action accordingly ");
     puts("By Brian Hrebec ("EMAIL")");
     puts("This is free software under the GNU General Public License (GPL v2)");
     puts("              (see COPYING in the joy2script archive)");
-    printf("Version: %s   Binary built on %s at %s\n\n", 
+    printf("Version: %s   Binary built on %s at %s\n\n",
 		   JOY2SCRIPT_VERSION, __DATE__, __TIME__);
 
-    memset(mode, 0, sizeof(mode));
-
     argc=check_config(argc, argv);
     process_args(argc, argv);
 
-    if((jsfd=open(device,O_RDONLY))==-1)
+    signal(SIGPIPE, SIG_IGN);
+
+    if (num_device_paths == 0)
+        device_paths[num_device_paths++] =
+            backend == BACKEND_EVDEV ? DEFAULT_EVDEV_DEVICE : DEFAULT_DEVICE;
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1 || timer_fd == -1 ||
+            watch_add(timer_fd, &timer_watch, WATCH_TIMERS, NULL))
     {
-		printf("Error opening %s!\n", device);
-		puts("Are you sure you have joystick support in your kernel?");
+		perror("joy2script: error setting up epoll");
 		return 1;
     }
-    if (ioctl(jsfd, JSIOCGAXES, &numaxes)) {
-/* acording to the American Heritage Dictionary of the English 
-   Language 'axes' *IS* the correct pluralization of 'axis' */
-		perror("joy2key: error getting axes"); 
+
+    if (bench_exec)
+        return executor_benchmark(bench_exec);
+    if (rt_test)
+        return realtime_test(rt_test);
+
+    if (stream.format && stream_init())
+    {
+		perror("joy2script: error setting up the event stream");
 		return 1;
     }
-    if (ioctl(jsfd, JSIOCGBUTTONS, &numbuttons)) {
-		perror("joy2key: error getting buttons");
+
+    if (replay_path)
+    {
+        realtime_init();
+        if (executor_init())
+        {
+            perror("joy2script: error setting up child processes");
+            return 1;
+        }
+        return replay_run(replay_path) ? 1 : 0;
+    }
+
+    if (record_path && record_open(record_path))
+    {
+		perror("joy2script: error opening the log");
+		return 1;
+    }
+
+    stats_start = monotonic_ns();
+    if (control_path && control_init())
+    {
+		perror("joy2script: error setting up the control socket");
+		return 1;
+    }
+
+    /* Watch for devices before looking for them, so nothing plugged in
+     * between the two is missed */
+    if (hotplug_init() ||
+            watch_add(hotplug_fd, &hotplug_watch, WATCH_HOTPLUG, NULL))
+    {
+		perror("joy2script: error watching for devices");
 		return 1;
     }
 
-    /* Invalidate all fds */
-    for (i = 0; i < numaxes; i++) 
-        mode[current_mode].axis[i].timer_fd = -1;
+    if (reader_init())
+    {
+		perror("joy2script: error setting up the input ring");
+		return 1;
+    }
 
-    for (i = 0; i < numbuttons; i++) 
-        mode[current_mode].button[i].timer_fd = -1;
+    devices_scan();
+    if (!devices)
+    {
+		printf("No joystick found at %s", device_paths[0]);
+        for (i = 1; i < num_device_paths; i++)
+            printf(", %s", device_paths[i]);
+		puts(", waiting for one to be plugged in.");
+		puts("Are you sure you have joystick support in your kernel?");
+    }
 
     signal(SIGINT, cleanup);
     signal(SIGTERM, cleanup);
 
-    if (daemonize) 
+    if (daemonize)
     {
         puts("Initialization complete, daemonizing...!\n");
         make_daemon();
@@ -161,621 +846,4897 @@ int main(int argc, char **argv)
         puts("Initialization complete, entering main loop, ^C to exit...");
     }
 
+    /* Memory locks don't survive the fork, so this waits for the daemon */
+    realtime_init();
 
-    /* Main Loop */
-    for(;;)
+    /* Start the shell workers after daemonizing so they belong to
+     * the daemon and not to the process that just exited */
+    if (executor_init())
     {
-        FD_ZERO(&js_fdset);
-		memset(&js, 0, sizeof(struct js_event));
+		perror("joy2script: error setting up child processes");
+		return 1;
+    }
 
-        /* Add timer fds to set for select() */
-        int nfds = 0;
-        for (i = 0; i < numaxes; i++)
-            if (mode[current_mode].axis[i].timer_fd != -1)
-                FD_SET(mode[current_mode].axis[i].timer_fd, &js_fdset);
-        nfds += i;
+    /* Also after daemonizing, as only the thread that forks carries on.
+     * It gets the real-time settings too. */
+    if (reader_start())
+    {
+		perror("joy2script: error watching the devices");
+		return 1;
+    }
 
-        for (i = 0; i < numbuttons; i++)
-            if (mode[current_mode].button[i].timer_fd != -1)
-                FD_SET(mode[current_mode].button[i].timer_fd, &js_fdset);
-        nfds += i;
+    /* Main Loop */
+    for(;;)
+        handle_events(-1);
+}
 
-        FD_SET(jsfd, &js_fdset); /* joystick fd */
-        nfds++;
+/* Wait for and handle one batch of events.  Nothing in here waits for
+ * a child process: they are started and forgotten, and reaped when
+ * SIGCHLD arrives through signal_fd. */
+void handle_events(int timeout)
+{
+    int i, nready;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
 
-        select (nfds, &js_fdset, NULL, NULL, NULL);
+    nready = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, timeout);
 
-        if (FD_ISSET(jsfd, &js_fdset)) 
-        {
-            read(jsfd, &js, sizeof(struct js_event));
-            switch(js.type)
-            {
-            case JS_EVENT_BUTTON:
-                button_event(js.number, js.value);
-                break;
-            case JS_EVENT_AXIS:
-                axis_event(js.number, js.value);
-                break;
-            }
-        } 
-        else 
+    for (i = 0; i < nready; i++)
+    {
+        struct s_watch *watch = events[i].data.ptr;
+
+        switch (watch->type)
         {
-            repeat_event(&js_fdset);
+        case WATCH_RING:
+            ring_drain();
+            break;
+        case WATCH_READER:
+            reader_poll(0);
+            break;
+        case WATCH_TIMERS:
+            timers_run();
+            break;
+        case WATCH_HOTPLUG:
+            hotplug_event();
+            break;
+        case WATCH_WORKER:
+            worker_done(watch->owner);
+            break;
+        case WATCH_SIGNALS:
+            signals_read();
+            break;
+        case WATCH_STREAM:
+            stream_accept();
+            break;
+        case WATCH_CONTROL:
+            control_accept();
+            break;
         }
     }
+
+    stream_flush();
+    sinks_flush();
+    if (record_file)
+        fflush(record_file);
+    devices_reap();
+    timers_arm();
 }
 
-void make_daemon() {
-    int pid, sid;
+/* Set up the ring and the reader thread's epoll before any device is
+ * attached; the thread itself waits for reader_start() */
+int reader_init()
+{
+    struct epoll_event ev;
+    struct s_watch *watch = malloc(sizeof(struct s_watch));
 
-    /* Fork off the parent process */
-    pid = fork();
-    if (pid < 0) {
-        exit(EXIT_FAILURE);
-    }
-    /* If we got a good PID, then
-       we can exit the parent process. */
-    if (pid > 0) {
-        exit(EXIT_SUCCESS);
-    }
+    for (ring.size = 2; ring.size < ring_size; ring.size <<= 1)
+        ;
+    ring.entries = calloc(ring.size, sizeof(struct s_ring_entry));
 
-    /* Change the file mode mask */
-    umask(0);
+    if ((reader_epfd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+            pipe2(reader_cmd, O_CLOEXEC) ||
+            fcntl(reader_cmd[0], F_SETFL, O_NONBLOCK) ||
+            (ring_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+            watch_add(ring_fd, watch, WATCH_RING, NULL))
+        return -1;
 
-    /* Create a new SID for the child process */
-    sid = setsid();
-    if (sid < 0) {
-        /* Log the failure */
-        exit(EXIT_FAILURE);
-    }
+    ev.events = EPOLLIN;
+    ev.data.u64 = READER_COMMAND;
+    return epoll_ctl(reader_epfd, EPOLL_CTL_ADD, reader_cmd[0], &ev);
+}
 
-    /* Change the current working directory */
-    if ((chdir("/")) < 0) {
-        /* Log the failure */
-        exit(EXIT_FAILURE);
-    }
+/* Hand a device to the reader thread.  It never touches the device
+ * itself, which the main thread may free at any time: its id, fd and
+ * whether it speaks evdev are all packed into the epoll data. */
+int reader_add(struct s_device *dev)
+{
+    struct epoll_event ev;
 
-    /* Close out the standard file descriptors */
-    close(STDIN_FILENO);
-    close(STDOUT_FILENO);
-    close(STDERR_FILENO);
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t)dev->id << 32 | (uint64_t)dev->fd << 1 |
+        (dev->backend == BACKEND_EVDEV);
+    return epoll_ctl(reader_epfd, EPOLL_CTL_ADD, dev->fd, &ev);
+}
+
+/* Queue an entry for the main thread.  Returns -1 if there is no room
+ * for it. */
+int ring_push(int device, ring_entry_type type, unsigned long long time,
+        const void *event, size_t size)
+{
+    unsigned int head = ring.head;
+    unsigned int used = head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+    struct s_ring_entry *entry;
+
+    if (used >= ring.size - (type == RING_EVENT))
+        return -1;
+    entry = &ring.entries[head & (ring.size - 1)];
+    entry->device = device;
+    entry->type = type;
+    entry->time = time;
+    memcpy(&entry->js, event, size);
+    __atomic_store_n(&ring.head, head + 1, __ATOMIC_RELEASE);
+    if (used + 1 > ring.high_water)
+        __atomic_store_n(&ring.high_water, used + 1, __ATOMIC_RELAXED);
+    return 0;
 }
 
-void repeat_event(fd_set *js_fdset) 
+/* Drain everything a device's driver has queued into the ring, a batch
+ * at a time.  Returns 1 if anything was queued. */
+int reader_read(uint64_t data)
 {
+    int id = data >> 32, fd = (data & 0xffffffff) >> 1;
+    size_t size = data & 1 ? sizeof(struct input_event) :
+        sizeof(struct js_event);
+    char buffer[JS_EVENT_BATCH * sizeof(struct input_event)];
+    unsigned long long now = 0;
+    ssize_t n;
     int i;
-    for (i = 0; i < numaxes; i++) 
+
+    while ((n = read(fd, buffer, JS_EVENT_BATCH * size)) > 0)
     {
-        struct s_axis* axis;
-        axis = &mode[current_mode].axis[i];
-        if (axis->timer_fd != -1 && 
-                FD_ISSET(axis->timer_fd, js_fdset)) 
+        /* js timestamps are milliseconds on a clock of their own */
+        now = monotonic_ns();
+        for (i = 0; i < n / size; i++)
         {
-            unsigned long long m;
-            read(axis->timer_fd, &m, sizeof(m));
-            send_axis_action(axis, axis->action_on);
+            if (!ring_push(id, RING_EVENT, now, buffer + i * size, size))
+            {
+                ring.overflowing = 0;
+                continue;
+            }
+            __atomic_fetch_add(&ring.overflows, 1, __ATOMIC_RELAXED);
+            if (!ring.overflowing)
+                ring.overflowing = !ring_push(-1, RING_OVERFLOW, now, NULL, 0);
         }
+        if (n < JS_EVENT_BATCH * size)
+            return now != 0;
     }
 
-    for (i = 0; i < numbuttons; i++) 
+    /* ENODEV once the joystick is unplugged.  Stop listening, and tell
+     * the main thread, which has to see it to detach the device: if the
+     * ring is full, wait for it to make room. */
+    if (n == 0 || (errno != EAGAIN && errno != EINTR))
     {
-        struct s_button* button;
-        button = &mode[current_mode].button[i];
-        if (button->timer_fd != -1 && 
-                FD_ISSET(button->timer_fd, js_fdset)) 
+        epoll_ctl(reader_epfd, EPOLL_CTL_DEL, fd, NULL);
+        while (ring_push(id, RING_GONE, monotonic_ns(), NULL, 0))
         {
-            unsigned long long m;
-            read(button->timer_fd, &m, sizeof(m));
-            system(button->action_on);
+            if (!reader_threaded)
+            {
+                ring_drain();
+                continue;
+            }
+            eventfd_write(ring_fd, 1);
+            usleep(1000);
         }
+        return 1;
     }
+    return now != 0;
 }
 
-void button_event(int number, int value) 
+/* Wait up to timeout ms for the devices and queue what they have */
+void reader_poll(int timeout)
 {
-    struct s_button* button;
-    button = &mode[current_mode].button[number];
-
-    if (value) 
-    {
-        button->on = 1;
-
-        if (button->repeat_rate > 0) 
-        {
-            struct itimerspec its;
-            its.it_interval.tv_sec = button->repeat_rate / 1000;
-            its.it_interval.tv_nsec = button->repeat_rate % 1000 * 1000000;
-            its.it_value.tv_sec = its.it_interval.tv_sec;
-            its.it_value.tv_nsec = its.it_interval.tv_nsec;
-            int tfd = timerfd_create(CLOCK_MONOTONIC, 0);
-            timerfd_settime(tfd, 0, &its, NULL);
-            button->timer_fd = tfd;
-        }
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int i, nready, fd, queued = 0, closing = 0;
 
-        system(button->action_on);
-    } 
-    else 
+    nready = epoll_wait(reader_epfd, events, MAX_EPOLL_EVENTS, timeout);
+    for (i = 0; i < nready; i++)
     {
-        button->on = 0;
+        if (events[i].data.u64 == READER_COMMAND)
+            closing = 1;
+        else
+            queued |= reader_read(events[i].data.u64);
+    }
 
-        if (button->timer_fd != -1) 
-        {
-            close(button->timer_fd);
-            button->timer_fd = -1;
-        }
+    /* After the reads: a closed fd can be reused by the next device
+     * opened, and a read for the old one must not get its events */
+    if (closing)
+        while (read(reader_cmd[0], &fd, sizeof(fd)) == sizeof(fd))
+            close(fd);
 
-        system(button->action_off);
-    }
+    if (queued)
+        eventfd_write(ring_fd, 1);
 }
 
-int scale_value(int value, int max, int lower, int upper)
+void *reader_run(void *unused)
 {
-    double v = (double)value / max;
-    int diff = upper - lower;
+    sigset_t all;
 
-    return (int) lower + (v * diff);
-}
+    /* Signals are for the main thread's signalfd */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
 
+    for (;;)
+        reader_poll(-1);
+    return NULL;
+}
 
-int timespec_subtract (struct timespec* result, 
-        struct timespec* x, struct timespec* y)
+/* Start the reader thread, with a small stack: under -lock-memory all
+ * of it is locked and counts against RLIMIT_MEMLOCK.  If it can't be
+ * started, the main loop polls the devices itself, through reader_epfd,
+ * and they are read only between actions as they used to be. */
+int reader_start()
 {
-    if (x->tv_nsec < y->tv_nsec) 
-    {
-        result->tv_sec = x->tv_sec - y->tv_sec - 1;
-        result->tv_nsec = 1000000000 + x->tv_nsec - y->tv_nsec;
-    }
-    else
+    static struct s_watch watch;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, READER_STACK);
+    errno = pthread_create(&reader_thread, &attr, reader_run, NULL);
+    pthread_attr_destroy(&attr);
+    if (!errno)
     {
-        result->tv_sec = x->tv_sec - y->tv_sec;
-        result->tv_nsec = x->tv_nsec - y->tv_nsec;
+        reader_threaded = 1;
+        return 0;
     }
 
-    /* Return 1 if result is negative. */
-    return result->tv_sec < 0 || result->tv_nsec < 0;
+    printf("joy2script: can't start the reader thread: %s, reading the "
+            "devices in the main loop\n", strerror(errno));
+    return watch_add(reader_epfd, &watch, WATCH_READER, NULL);
 }
 
+struct s_device *device_find(int id)
+{
+    struct s_device *dev;
+
+    for (dev = devices; dev; dev = dev->next)
+        if (dev->id == id)
+            return dev->fd == -1 ? NULL : dev;
+    return NULL;
+}
 
-void axis_event(int number, int value)
+/* Events were dropped for want of room in the ring.  evdev can find out
+ * where everything is now, as after SYN_DROPPED; js can't. */
+void ring_overflowed()
 {
-    struct s_axis* axis;
-    axis = &mode[current_mode].axis[number];
+    struct s_device *dev;
 
-    if (axis->asymmetric)
-        axis->value = value + 32767;
-    else
-        axis->value = value;
-    
+    for (dev = devices; dev; dev = dev->next)
+        if (dev->fd != -1 && dev->evdev)
+        {
+            dev->evdev->frame_len = 0;
+            dev->evdev->dropped = 1;
+        }
+}
 
-    if ((abs(axis->value) < axis->deadzone - axis->deadzone_size) 
-            && axis->on) 
+/* Hand what the reader thread has queued to the devices, each run of
+ * events read from a device in one go as one batch */
+void ring_drain()
+{
+    union {
+        struct js_event js[JS_EVENT_BATCH];
+        struct input_event ev[JS_EVENT_BATCH];
+    } batch;
+    struct s_ring_entry *entry, *next;
+    struct s_device *dev;
+    unsigned long long time;
+    unsigned int tail = ring.tail, head;
+    eventfd_t wakeups;
+    int count;
+
+    eventfd_read(ring_fd, &wakeups);
+    head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+    while (tail != head)
     {
-        /*turn it off*/
-        send_axis_action(axis, axis->action_off);
-        axis->on=0;
+        entry = &ring.entries[tail++ & (ring.size - 1)];
+        dev = device_find(entry->device);
+        time = entry->time;
 
-        if (axis->timer_fd != -1) 
+        if (entry->type != RING_EVENT)
         {
-            close(axis->timer_fd);
-            axis->timer_fd = -1;
+            __atomic_store_n(&ring.tail, tail, __ATOMIC_RELEASE);
+            if (entry->type == RING_OVERFLOW)
+                ring_overflowed();
+            else if (dev)
+                device_detach(dev);
+            continue;
         }
-    }
-    else if ((abs(axis->value) > 
-                axis->deadzone + axis->deadzone_size) ) 
-    {
-        if (!axis->on || 
-            (axis->repeat && axis->repeat_rate_low == 0 &&
-                    axis->repeat_rate_high == 0)) 
+
+        for (count = 0; ; entry = next, tail++)
         {
-            send_axis_action(axis, axis->action_on);
+            if (dev && dev->backend == BACKEND_EVDEV)
+                batch.ev[count++] = entry->ev;
+            else
+                batch.js[count++] = entry->js;
+            if (count == JS_EVENT_BATCH || tail == head)
+                break;
+            next = &ring.entries[tail & (ring.size - 1)];
+            if (next->type != RING_EVENT || next->device != entry->device ||
+                    next->time != time)
+                break;
         }
+        /* Copied out: the reader can have the room back while these are
+         * dispatched */
+        __atomic_store_n(&ring.tail, tail, __ATOMIC_RELEASE);
 
-        if (axis->repeat && (axis->repeat_rate_low != 0 || 
-                  axis->repeat_rate_high != 0)) {
+        if (!dev)
+            continue;
+        if (dev->backend == BACKEND_EVDEV)
+        {
+            evdev_frames(dev, batch.ev, count);
+        }
+        else
+        {
+            dev->event_time = time;
+            dispatch_events(dev, batch.js, count);
+        }
+    }
+}
 
-            int ms;
-            if (axis->asymmetric)
-                ms = scale_value(axis->value, 65536, 
-                        axis->repeat_rate_low, axis->repeat_rate_high);
-            else
-                ms = scale_value(axis->value, 32768, 
-                        axis->repeat_rate_low, axis->repeat_rate_high);
-
-            int tfd;
-            struct itimerspec its;
-            struct itimerspec current_its;
-            its.it_interval.tv_sec = ms / 1000;
-            its.it_interval.tv_nsec = ms % 1000 * 1000000;
-            its.it_value.tv_sec = its.it_interval.tv_sec;
-            its.it_value.tv_nsec = its.it_interval.tv_nsec;
-
-            if (axis->timer_fd == -1) 
-            {
-                tfd = timerfd_create(CLOCK_MONOTONIC, 0);
-                memset(&current_its, 0, sizeof(current_its));
-            } 
-            else 
-            {
-                tfd = axis->timer_fd;
-                timerfd_gettime(tfd, &current_its);
-            }
+#define test_bit(bit, array) ((array)[(bit) / 8] & (1 << ((bit) % 8)))
 
-            /* If the amount of time  is less than
-             * the amount the new timer wants, set the difference
-             * as the new time. */
-            struct timespec elapsed_time;
-            timespec_subtract(&elapsed_time, &axis->old_its.it_value, 
-                    &current_its.it_value);
-            axis->old_its = its;
+/* Scale an absolute axis to the -32767..32767 range joydev reports */
+int evdev_scale(struct s_evdev *evdev, int code, int value)
+{
+    long long range = evdev->abs_max[code] - evdev->abs_min[code];
 
-            if (elapsed_time.tv_sec < its.it_value.tv_sec ||
-                    elapsed_time.tv_nsec < its.it_value.tv_nsec)
-            {
-                timespec_subtract(&its.it_value,
-                       &its.it_value, &elapsed_time);
+    if (range <= 0)
+        return 0;
+    value = (2LL * (value - evdev->abs_min[code]) - range) * 32767 / range;
+    if (value > 32767)
+        return 32767;
+    if (value < -32767)
+        return -32767;
+    return value;
+}
 
-            }
+void evdev_frame_add(struct s_device *dev, int type, int number, int value)
+{
+    struct s_evdev *evdev = dev->evdev;
+    struct js_event *js;
+
+    if (evdev->frame_len == JS_EVENT_BATCH)
+    {
+        /* An unusually big frame: hand over what we have so far */
+        dispatch_events(dev, evdev->frame, evdev->frame_len);
+        evdev->frame_len = 0;
+        if (dev->fd == -1)
+            return;
+    }
+
+    js = &evdev->frame[evdev->frame_len++];
+    js->time = dev->event_time / 1000000;
+    js->type = type;
+    js->number = number;
+    js->value = value;
+}
 
+/* After SYN_DROPPED the events we lost are gone for good, so ask the
+ * kernel where everything is now and replay the differences */
+void evdev_resync(struct s_device *dev)
+{
+    struct s_evdev *evdev = dev->evdev;
+    unsigned char keys[KEY_CNT / 8 + 1];
+    struct input_absinfo absinfo;
+    int code, number;
 
-            timerfd_settime(tfd, 0, &its, NULL);
-            axis->timer_fd = tfd;
+    memset(keys, 0, sizeof(keys));
+    ioctl(dev->fd, EVIOCGKEY(sizeof(keys)), keys);
+    for (code = BTN_MISC; code < KEY_CNT; code++)
+    {
+        number = evdev->button_map[code - BTN_MISC];
+        if (number < 0)
+            continue;
+        if (!test_bit(code, keys) != !test_bit(code - BTN_MISC,
+                    evdev->key_state))
+        {
+            evdev->key_state[(code - BTN_MISC) / 8] ^=
+                1 << ((code - BTN_MISC) % 8);
+            evdev_frame_add(dev, JS_EVENT_BUTTON, number,
+                    test_bit(code, keys) ? 1 : 0);
         }
+    }
 
-        axis->on=1;
+    for (code = 0; code < ABS_CNT; code++)
+    {
+        number = evdev->axis_map[code];
+        if (number >= 0 && !ioctl(dev->fd, EVIOCGABS(code), &absinfo))
+            evdev_frame_add(dev, JS_EVENT_AXIS, number,
+                    evdev_scale(evdev, code, absinfo.value));
     }
 }
 
-void send_axis_action(struct s_axis *axis, char* action)
+/* Dispatch input_events a SYN_REPORT frame at a time, so axes that
+ * changed together are handled together and stamped with the kernel's
+ * time for the frame */
+void evdev_frames(struct s_device *dev, struct input_event *ev, int count)
 {
-	char buffer[MAX_ACTION_STRING];
-    char *p_buffer = buffer;
-	int len=0;
-	char val[64];
+    struct s_evdev *evdev = dev->evdev;
+    int i, number;
 
-	if (!action) 
-        return;
-
-    while (*action != '\0')
+    for (i = 0; i < count; i++)
     {
-        if (len > MAX_ACTION_STRING - 1) {
-            printf("Error: action string too long");
-            return;
-        }
+        dev->event_time = ev[i].input_event_sec * 1000000000ULL +
+            ev[i].input_event_usec * 1000ULL;
 
-        if (*action == '%')   
+        switch (ev[i].type)
         {
-            action++;
-            char spec = *action++;
-            if (spec == 'v') /*value*/				
+        case EV_SYN:
+            if (ev[i].code == SYN_DROPPED)
             {
-                int cvalue;
-                if (axis->asymmetric)
-                    cvalue = scale_value(axis->value, 65536, 
-                            axis->output_low, axis->output_high);
-                else
-                    cvalue = scale_value(axis->value, 32768, 
-                            axis->output_low, axis->output_high);
-
-                sprintf(val, "%d", cvalue);
-                char *v = val;
-                while (*v) {
-                    *p_buffer++ = *v++;
-                    len++;
-                }
-
-                continue;
+                evdev->frame_len = 0;
+                evdev->dropped = 1;
             }
-            else if (spec == 's') /*sign */
+            else if (ev[i].code == SYN_REPORT)
             {
-                sprintf(val, "%s", axis->value < 0 ? "-1" : "+1");
-                char *v = val;
-                while (*v) {
-                    *p_buffer++ = *v++;
-                    len++;
+                if (evdev->dropped)
+                {
+                    evdev->dropped = 0;
+                    evdev_resync(dev);
                 }
-                continue;
-            } else {
-                *p_buffer++ = '%';
-                *p_buffer++ = spec;
-                len += 2;
+                if (evdev->frame_len)
+                    dispatch_events(dev, evdev->frame, evdev->frame_len);
+                evdev->frame_len = 0;
             }
-        } 
-        else 
-        {
-            *p_buffer++ = *action++;
+            break;
+        case EV_ABS:
+            if (evdev->dropped || ev[i].code >= ABS_CNT ||
+                    (number = evdev->axis_map[ev[i].code]) < 0)
+                break;
+            evdev_frame_add(dev, JS_EVENT_AXIS, number,
+                    evdev_scale(evdev, ev[i].code, ev[i].value));
+            break;
+        case EV_KEY:
+            /* value 2 is the keyboard-style autorepeat */
+            if (evdev->dropped || ev[i].code < BTN_MISC ||
+                    ev[i].code >= KEY_CNT || ev[i].value == 2 ||
+                    (number = evdev->button_map[ev[i].code - BTN_MISC]) < 0)
+                break;
+            if (ev[i].value)
+                evdev->key_state[(ev[i].code - BTN_MISC) / 8] |=
+                    1 << ((ev[i].code - BTN_MISC) % 8);
+            else
+                evdev->key_state[(ev[i].code - BTN_MISC) / 8] &=
+                    ~(1 << ((ev[i].code - BTN_MISC) % 8));
+            evdev_frame_add(dev, JS_EVENT_BUTTON, number, ev[i].value);
+            break;
         }
+
+        if (dev->fd == -1)
+            return;
+    }
+}
+
+/* Number the axes and buttons the way joydev does, and skip anything
+ * that isn't a joystick (keyboards, mice...).  Returns -1 to skip. */
+int evdev_setup(struct s_device *dev)
+{
+    unsigned char abs_bits[ABS_CNT / 8 + 1];
+    unsigned char key_bits[KEY_CNT / 8 + 1];
+    struct input_absinfo absinfo;
+    struct s_evdev *evdev;
+    int code, clock = CLOCK_MONOTONIC;
+    int joystick = 0;
+
+    memset(abs_bits, 0, sizeof(abs_bits));
+    memset(key_bits, 0, sizeof(key_bits));
+    if (ioctl(dev->fd, EVIOCGBIT(EV_ABS, sizeof(abs_bits)), abs_bits) < 0 ||
+            ioctl(dev->fd, EVIOCGBIT(EV_KEY, sizeof(key_bits)), key_bits) < 0)
+        return -1;
+
+    for (code = BTN_JOYSTICK; code < BTN_DIGI; code++)
+        if (test_bit(code, key_bits))
+            joystick = 1;
+    if (test_bit(BTN_TRIGGER_HAPPY1, key_bits))
+        joystick = 1;
+    if (!joystick)
+        return -1;
+
+    /* Timestamps on the same clock as the repeat timers */
+    if (ioctl(dev->fd, EVIOCSCLOCKID, &clock))
+        return -1;
+
+    evdev = calloc(1, sizeof(struct s_evdev));
+    memset(evdev->axis_map, -1, sizeof(evdev->axis_map));
+    memset(evdev->button_map, -1, sizeof(evdev->button_map));
+
+    dev->numaxes = 0;
+    for (code = 0; code < ABS_CNT && dev->numaxes < 255; code++)
+    {
+        if (!test_bit(code, abs_bits) ||
+                ioctl(dev->fd, EVIOCGABS(code), &absinfo))
+            continue;
+        evdev->axis_map[code] = dev->numaxes++;
+        evdev->abs_min[code] = absinfo.minimum;
+        evdev->abs_max[code] = absinfo.maximum;
+    }
+
+    dev->numbuttons = 0;
+    for (code = BTN_JOYSTICK; code < KEY_CNT && dev->numbuttons < 255; code++)
+        if (test_bit(code, key_bits))
+            evdev->button_map[code - BTN_MISC] = dev->numbuttons++;
+    for (code = BTN_MISC; code < BTN_JOYSTICK && dev->numbuttons < 255; code++)
+        if (test_bit(code, key_bits))
+            evdev->button_map[code - BTN_MISC] = dev->numbuttons++;
+
+    dev->evdev = evdev;
+    return 0;
+}
+
+int device_wanted(const char *path)
+{
+    int i;
+
+    for (i = 0; i < num_device_paths; i++)
+        if (!fnmatch(device_paths[i], path, FNM_PATHNAME))
+            return 1;
+    return 0;
+}
+
+struct s_profile *profile_for(struct s_bindings *b, const char *path,
+        const char *name)
+{
+    struct s_profile *profile;
+
+    for (profile = b->profiles; profile; profile = profile->next)
+        if (!fnmatch(profile->match, path, 0) ||
+                !fnmatch(profile->match, name, 0))
+            return profile;
+    return &b->default_profile;
+}
+
+/* Set up the device's state tables for the modes the profile defines */
+void device_bind(struct s_device *dev, struct s_profile *profile)
+{
+    struct s_mode *mode;
+    int m, i;
+
+    dev->num_modes = profile->num_modes ? profile->num_modes : 1;
+    dev->current_mode = 0;
+    dev->profile = profile;
+    dev->axis = calloc(dev->num_modes * dev->numaxes + 1,
+            sizeof(struct s_axis));
+    dev->button = calloc(dev->num_modes * dev->numbuttons + 1,
+            sizeof(struct s_button));
+    dev->combo = calloc(dev->num_modes, sizeof(struct s_combo_state));
+
+    for (m = 0; m < dev->num_modes; m++)
+    {
+        mode = &profile->mode[m];
+        for (i = 0; i < dev->numaxes; i++)
+            dev->axis[m * dev->numaxes + i].config = i < mode->num_axes ?
+                &mode->axis[i] : &unbound_axis;
+        for (i = 0; i < dev->numbuttons; i++)
+            dev->button[m * dev->numbuttons + i].config =
+                i < mode->num_buttons ? &mode->button[i] : &unbound_button;
+    }
+}
+
+struct s_device *device_attach(const char *path)
+{
+    struct s_device *dev;
+
+    for (dev = devices; dev; dev = dev->next)
+        if (dev->fd != -1 && !strcmp(dev->path, path))
+            return dev;
+
+    dev = calloc(1, sizeof(struct s_device));
+    dev->backend = backend;
+    if((dev->fd=open(path,O_RDONLY | O_NONBLOCK | O_CLOEXEC))==-1)
+    {
+        free(dev);
+        return NULL;
+    }
+
+    if (dev->backend == BACKEND_EVDEV)
+    {
+        if (evdev_setup(dev))
+        {
+            close(dev->fd);
+            free(dev);
+            return NULL;
+        }
+        if (ioctl(dev->fd, EVIOCGNAME(MAX_DEVICE_NAME), dev->name) < 0)
+            strcpy(dev->name, "Unknown");
+    }
+    else if (ioctl(dev->fd, JSIOCGAXES, &dev->numaxes)) {
+/* acording to the American Heritage Dictionary of the English
+   Language 'axes' *IS* the correct pluralization of 'axis' */
+        if (errno != ENOTTY && errno != EINVAL)
+        {
+            perror("joy2key: error getting axes");
+            close(dev->fd);
+            free(dev);
+            return NULL;
+        }
+
+        /* Not a joystick, but it may be a FIFO being fed js_events by
+         * a test harness: give it every axis and button there can be */
+        dev->numaxes = MAX_CONTROLS - 1;
+        dev->numbuttons = MAX_CONTROLS - 1;
+        strcpy(dev->name, "js_event stream");
+    }
+    else if (ioctl(dev->fd, JSIOCGBUTTONS, &dev->numbuttons)) {
+		perror("joy2key: error getting buttons");
+        close(dev->fd);
+        free(dev);
+		return NULL;
+    }
+    else if (ioctl(dev->fd, JSIOCGNAME(MAX_DEVICE_NAME), dev->name) < 0)
+        strcpy(dev->name, "Unknown");
+
+    dev->id = next_device_id++;
+    if (reader_add(dev))
+    {
+        close(dev->fd);
+        free(dev->evdev);
+        free(dev);
+        return NULL;
+    }
+
+    dev->path = strdup(path);
+    return device_add(dev);
+}
+
+/* Bind a newly opened device to its profile and start handling it.
+ * The path, name, id, fd and counts of axes and buttons are filled in. */
+struct s_device *device_add(struct s_device *dev)
+{
+    struct s_profile *profile;
+
+    profile = profile_for(bindings, dev->path, dev->name);
+    device_bind(dev, profile);
+
+    dev->next = devices;
+    devices = dev;
+    if (stream.format)
+        stream_device(dev, STREAM_ATTACH);
+    if (record_file)
+        record_device(dev, LOG_ATTACH);
+
+    printf("Attached %s (%s): %d axes, %d buttons, %s\n", dev->path, dev->name,
+            dev->numaxes, dev->numbuttons,
+            profile->match ? profile->match : "default bindings");
+    printf("    %d modes, %zu bytes of state (%zu per mode)\n",
+            dev->num_modes, dev->num_modes *
+            (dev->numaxes * sizeof(struct s_axis) +
+             dev->numbuttons * sizeof(struct s_button)),
+            dev->numaxes * sizeof(struct s_axis) +
+            dev->numbuttons * sizeof(struct s_button));
+    return dev;
+}
+
+/* Make mode the active binding table.  Every mode already has its own
+ * state, so this is just a change of index; what is left is to drop the
+ * old mode's repeats and forget what it had held, so that controls held
+ * across the switch don't fire their old action_off on release. */
+void device_set_mode(struct s_device *dev, int mode)
+{
+    struct s_axis *axis = &dev->axis[dev->current_mode * dev->numaxes];
+    struct s_button *button =
+        &dev->button[dev->current_mode * dev->numbuttons];
+    int i;
+
+    if (mode == dev->current_mode)
+        return;
+
+    for (i = 0; i < dev->numaxes; i++)
+    {
+        timer_cancel(&axis[i].timer);
+        timer_cancel(&axis[i].flush);
+        axis[i].on = 0;
+    }
+    for (i = 0; i < dev->numbuttons; i++)
+    {
+        timer_cancel(&button[i].timer);
+        button[i].on = 0;
+    }
+    memset(&dev->combo[dev->current_mode], 0, sizeof(struct s_combo_state));
+
+    dev->current_mode = mode;
+    printf("%s: mode %d\n", dev->path, mode);
+}
+
+int axis_config_equal(const struct s_axis_config *a,
+        const struct s_axis_config *b)
+{
+    /* Commands are interned, so the same text is the same pointer */
+    return a == b || ((a->action_on ? a->action_on->command : NULL) ==
+            (b->action_on ? b->action_on->command : NULL) &&
+        (a->action_off ? a->action_off->command : NULL) ==
+            (b->action_off ? b->action_off->command : NULL) &&
+        a->deadzone == b->deadzone && a->deadzone_size == b->deadzone_size &&
+        a->asymmetric == b->asymmetric && a->repeat == b->repeat &&
+        a->repeat_rate_low == b->repeat_rate_low &&
+        a->repeat_rate_high == b->repeat_rate_high &&
+        a->output_low == b->output_low && a->output_high == b->output_high &&
+        a->max_running == b->max_running && a->smoothing == b->smoothing &&
+        a->min_delta == b->min_delta && a->max_rate == b->max_rate &&
+        a->overrun == b->overrun && a->integrate == b->integrate &&
+        curve_equal(&a->curve, &b->curve));
+}
+
+int button_config_equal(const struct s_button_config *a,
+        const struct s_button_config *b)
+{
+    return a == b || ((a->action_on ? a->action_on->command : NULL) ==
+            (b->action_on ? b->action_on->command : NULL) &&
+        (a->action_off ? a->action_off->command : NULL) ==
+            (b->action_off ? b->action_off->command : NULL) &&
+        a->repeat_rate == b->repeat_rate && a->max_running == b->max_running &&
+        a->overrun == b->overrun);
+}
+
+/* Move a device onto a newly loaded profile.  Controls whose binding is
+ * the same as before keep what they were doing, repeats included; the
+ * rest, and all chords and sequences, start afresh as if the mode had
+ * just been switched to. */
+void device_rebind(struct s_device *dev, struct s_profile *profile)
+{
+    struct s_combo_state *old_combo = dev->combo;
+    struct s_axis *old_axis = dev->axis, *axis;
+    struct s_button *old_button = dev->button, *button;
+    int old_modes = dev->num_modes, mode = dev->current_mode;
+    int m, i, j;
+
+    device_bind(dev, profile);
+    if (mode < dev->num_modes)
+        dev->current_mode = mode;
+
+    for (m = 0; m < old_modes; m++)
+    {
+        for (i = 0; i < dev->numaxes; i++)
+        {
+            j = m * dev->numaxes + i;
+            axis = &dev->axis[j];
+            if (m < dev->num_modes &&
+                    axis_config_equal(old_axis[j].config, axis->config))
+            {
+                axis->value = old_axis[j].value;
+                axis->on = old_axis[j].on;
+                axis->passed = old_axis[j].passed;
+                axis->smoothed = old_axis[j].smoothed;
+                axis->pending = old_axis[j].pending;
+                axis->passed_at = old_axis[j].passed_at;
+                axis->integral = old_axis[j].integral;
+                axis->integrated_at = old_axis[j].integrated_at;
+                if (old_axis[j].timer.heap_index)
+                    timer_schedule(&axis->timer, TIMER_AXIS, axis,
+                            old_axis[j].timer.deadline,
+                            old_axis[j].timer.interval);
+                if (old_axis[j].flush.heap_index)
+                    timer_schedule(&axis->flush, TIMER_FLUSH, dev,
+                            old_axis[j].flush.deadline, 0);
+            }
+            timer_cancel(&old_axis[j].timer);
+            timer_cancel(&old_axis[j].flush);
+        }
+        for (i = 0; i < dev->numbuttons; i++)
+        {
+            j = m * dev->numbuttons + i;
+            button = &dev->button[j];
+            if (m < dev->num_modes &&
+                    button_config_equal(old_button[j].config, button->config))
+            {
+                button->on = old_button[j].on;
+                if (old_button[j].timer.heap_index)
+                    timer_schedule(&button->timer, TIMER_BUTTON, button,
+                            old_button[j].timer.deadline,
+                            old_button[j].timer.interval);
+            }
+            timer_cancel(&old_button[j].timer);
+        }
+    }
+    free(old_axis);
+    free(old_button);
+    free(old_combo);
+}
+
+/* Run action if it is a builtin.  Returns 0 if it is an ordinary
+ * command that still needs to be sent. */
+int device_builtin(struct s_device *dev, struct s_action *action)
+{
+    int mode;
+
+    /* Sinks don't need the device, they go out with the commands */
+    if (!action || action->builtin != BUILTIN_MODE)
+        return 0;
+
+    if (action->mode_step)
+        mode = (dev->current_mode + action->mode_step + dev->num_modes) %
+            dev->num_modes;
+    else
+        mode = action->mode;
+
+    if (mode >= dev->num_modes)
+        printf("%s: no mode %d\n", dev->path, mode);
+    else
+        device_set_mode(dev, mode);
+    return 1;
+}
+
+void device_detach(struct s_device *dev)
+{
+    int i;
+
+    if (dev->fd == -1)
+        return;
+
+    for (i = 0; i < dev->num_modes * dev->numaxes; i++)
+    {
+        timer_cancel(&dev->axis[i].timer);
+        timer_cancel(&dev->axis[i].flush);
+    }
+    for (i = 0; i < dev->num_modes * dev->numbuttons; i++)
+        timer_cancel(&dev->button[i].timer);
+
+    if (reader_epfd != -1)
+    {
+        epoll_ctl(reader_epfd, EPOLL_CTL_DEL, dev->fd, NULL);
+        if (write(reader_cmd[1], &dev->fd, sizeof(dev->fd)) < 0)
+            close(dev->fd);
+    }
+    else
+    {
+        close(dev->fd);
+    }
+    dev->fd = -1;
+    if (stream.format)
+        stream_device(dev, STREAM_DETACH);
+    if (record_file)
+        record_device(dev, LOG_DETACH);
+    printf("Detached %s (worst input lag %llu us)\n", dev->path,
+            dev->lag_max / 1000);
+}
+
+void devices_reap()
+{
+    struct s_device **p = &devices;
+    struct s_device *dev;
+
+    while ((dev = *p))
+    {
+        if (dev->fd == -1)
+        {
+            *p = dev->next;
+            free(dev->evdev);
+            free(dev->axis);
+            free(dev->button);
+            free(dev->combo);
+            free(dev->path);
+            free(dev);
+        }
+        else
+        {
+            p = &dev->next;
+        }
+    }
+}
+
+/* Attach whatever is already plugged in */
+void devices_scan()
+{
+    glob_t found;
+    int i;
+    size_t j;
+
+    for (i = 0; i < num_device_paths; i++)
+    {
+        if (glob(device_paths[i], 0, NULL, &found))
+            continue;
+        for (j = 0; j < found.gl_pathc; j++)
+            device_attach(found.gl_pathv[j]);
+        globfree(&found);
+    }
+}
+
+int hotplug_init()
+{
+    int i, j;
+    char *copy, *dir;
+
+    if ((hotplug_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+        return -1;
+
+    for (i = 0; i < num_device_paths; i++)
+    {
+        copy = strdup(device_paths[i]);
+        dir = strdup(dirname(copy));
+        free(copy);
+
+        for (j = 0; j < num_hotplug_dirs; j++)
+            if (!strcmp(hotplug_dirs[j], dir))
+                break;
+        if (j < num_hotplug_dirs)
+        {
+            free(dir);
+            continue;
+        }
+
+        /* udev creates the node and then fixes its permissions, so
+         * attributes changing is another chance to open it */
+        hotplug_wd[num_hotplug_dirs] = inotify_add_watch(hotplug_fd, dir,
+                IN_CREATE | IN_ATTRIB | IN_DELETE | IN_MOVED_TO);
+        if (hotplug_wd[num_hotplug_dirs] == -1)
+            printf("Can't watch %s for new devices\n", dir);
+        hotplug_dirs[num_hotplug_dirs++] = dir;
+    }
+
+    /* Editors often write a new file and rename it over the old one, so
+     * watch the directory rather than the file */
+    copy = strdup(config_file);
+    config_name = strdup(basename(copy));
+    free(copy);
+    copy = strdup(config_file);
+    config_wd = inotify_add_watch(hotplug_fd, dirname(copy),
+            IN_CLOSE_WRITE | IN_MOVED_TO | IN_MASK_ADD);
+    if (config_wd == -1)
+        printf("Can't watch %s for changes\n", config_file);
+    free(copy);
+    return 0;
+}
+
+void hotplug_event()
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    char path[PATH_MAX];
+    struct inotify_event *event;
+    struct s_device *dev;
+    ssize_t n;
+    char *p;
+    int i, reload = 0;
+
+    while ((n = read(hotplug_fd, buf, sizeof(buf))) > 0)
+    {
+        for (p = buf; p < buf + n; p += sizeof(*event) + event->len)
+        {
+            event = (struct inotify_event *)p;
+            if (!event->len)
+                continue;
+
+            /* A save can take several events: reload once at the end */
+            if (event->wd == config_wd && !strcmp(event->name, config_name) &&
+                    (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)))
+                reload = 1;
+
+            for (i = 0; i < num_hotplug_dirs; i++)
+                if (hotplug_wd[i] == event->wd)
+                    break;
+            if (i == num_hotplug_dirs)
+                continue;
+
+            snprintf(path, sizeof(path), "%s/%s", hotplug_dirs[i],
+                    event->name);
+            if (!device_wanted(path))
+                continue;
+
+            if (event->mask & IN_DELETE)
+            {
+                for (dev = devices; dev; dev = dev->next)
+                    if (!strcmp(dev->path, path))
+                        device_detach(dev);
+            }
+            else
+            {
+                device_attach(path);
+            }
+        }
+    }
+
+    if (reload)
+        config_reload();
+}
+
+/* Which side of the deadzone value is on: 0 inside, otherwise the sign */
+int axis_zone(struct s_device *dev, int number, int value)
+{
+    const struct s_axis_config* config;
+
+    if (number >= dev->numaxes)
+        return 0;
+    config = dev->axis[dev->current_mode * dev->numaxes + number].config;
+
+    if (config->asymmetric)
+        value += 32767;
+    if (abs(value) < config->deadzone)
+        return 0;
+    return value < 0 ? -1 : 1;
+}
+
+/* Handle a batch of events read in one go.  Only the newest position of
+ * each axis matters, so motion that is followed later in the batch by
+ * more motion of the same axis in the same zone is dropped before 
+ * dispatch.  Deadzone crossings are kept so a quick flick of a hat still
+ * turns on and off.  Buttons and the surviving axis events are handled
+ * in the order they arrived. */
+void dispatch_events(struct s_device *dev, struct js_event *js, int count)
+{
+    unsigned char axis_seen[256 / 8];
+    signed char axis_next_zone[256];
+    unsigned long long now = monotonic_ns();
+    int i, zone;
+
+    /* Before coalescing, which rewrites js */
+    if (record_file)
+        record_events(dev, js, count);
+
+    dev->lag_last = now > dev->event_time ? now - dev->event_time : 0;
+    if (dev->lag_last > dev->lag_max)
+        dev->lag_max = dev->lag_last;
+    hist_record(HIST_INPUT, dev->lag_last);
+    action_origin = dev->event_time;
+#if DEBUG
+    printf("%s: %d events, %llu us after the kernel saw them\n", dev->path,
+            count, dev->lag_last / 1000);
+#endif
+
+    memset(axis_seen, 0, sizeof(axis_seen));
+    for (i = count - 1; i >= 0; i--)
+    {
+        if (js[i].type != JS_EVENT_AXIS)
+            continue;
+        zone = axis_zone(dev, js[i].number, js[i].value);
+        if ((axis_seen[js[i].number / 8] & (1 << js[i].number % 8)) &&
+                axis_next_zone[js[i].number] == zone)
+        {
+            js[i].type = 0;
+            continue;
+        }
+        axis_seen[js[i].number / 8] |= 1 << js[i].number % 8;
+        axis_next_zone[js[i].number] = zone;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        switch(js[i].type)
+        {
+        case JS_EVENT_BUTTON:
+            button_event(dev, js[i].number, js[i].value);
+            if (stream.format)
+                stream_event(dev, JS_EVENT_BUTTON, js[i].number);
+            break;
+        case JS_EVENT_AXIS:
+            axis_event(dev, js[i].number, js[i].value);
+            if (stream.format)
+                stream_event(dev, JS_EVENT_AXIS, js[i].number);
+            break;
+        }
+    }
+}
+
+void make_daemon() {
+    int pid, sid;
+
+    /* Fork off the parent process */
+    pid = fork();
+    if (pid < 0) {
+        exit(EXIT_FAILURE);
+    }
+    /* If we got a good PID, then
+       we can exit the parent process. */
+    if (pid > 0) {
+        exit(EXIT_SUCCESS);
+    }
+
+    /* Change the file mode mask */
+    umask(0);
+
+    /* Create a new SID for the child process */
+    sid = setsid();
+    if (sid < 0) {
+        /* Log the failure */
+        exit(EXIT_FAILURE);
+    }
+
+    /* Change the current working directory */
+    if ((chdir("/")) < 0) {
+        /* Log the failure */
+        exit(EXIT_FAILURE);
+    }
+
+    /* Close out the standard file descriptors */
+    close(STDIN_FILENO);
+    close(STDOUT_FILENO);
+    close(STDERR_FILENO);
+    daemonized = 1;
+}
+
+/* Report a problem met while running: on stderr, or to syslog once the
+ * daemon has no stderr */
+void log_warning(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    if (daemonized)
+        vsyslog(LOG_DAEMON | LOG_WARNING, format, args);
+    else
+    {
+        vfprintf(stderr, format, args);
+        fputc('\n', stderr);
+    }
+    va_end(args);
+}
+
+int watch_add(int fd, struct s_watch *watch, watch_type type, void *owner)
+{
+    struct epoll_event ev;
+
+    watch->type = type;
+    watch->owner = owner;
+    ev.events = EPOLLIN;
+    ev.data.ptr = watch;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+unsigned long long monotonic_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void timer_heap_place(struct s_timer *timer, int index)
+{
+    timer_heap[index] = timer;
+    timer->heap_index = index;
+}
+
+void timer_sift_up(struct s_timer *timer)
+{
+    int index = timer->heap_index;
+
+    while (index > 1 &&
+            timer_heap[index / 2]->deadline > timer->deadline)
+    {
+        timer_heap_place(timer_heap[index / 2], index);
+        index /= 2;
+    }
+    timer_heap_place(timer, index);
+}
+
+void timer_sift_down(struct s_timer *timer)
+{
+    int index = timer->heap_index;
+    int child;
+
+    while ((child = index * 2) <= timer_count)
+    {
+        if (child < timer_count &&
+                timer_heap[child + 1]->deadline < timer_heap[child]->deadline)
+            child++;
+        if (timer_heap[child]->deadline >= timer->deadline)
+            break;
+        timer_heap_place(timer_heap[child], index);
+        index = child;
+    }
+    timer_heap_place(timer, index);
+}
+
+void timer_schedule(struct s_timer *timer, timer_type type, void *owner,
+        unsigned long long deadline, unsigned long long interval)
+{
+    timer->type = type;
+    timer->owner = owner;
+    timer->interval = interval;
+
+    if (timer->heap_index)
+    {
+        unsigned long long old = timer->deadline;
+        timer->deadline = deadline;
+        if (deadline < old)
+            timer_sift_up(timer);
+        else
+            timer_sift_down(timer);
+        return;
+    }
+
+    if (timer_count + 1 >= timer_capacity)
+    {
+        timer_capacity = timer_capacity ? timer_capacity * 2 : 32;
+        timer_heap = realloc(timer_heap,
+                timer_capacity * sizeof(struct s_timer *));
+    }
+
+    timer->deadline = deadline;
+    timer->heap_index = ++timer_count;
+    timer_sift_up(timer);
+}
+
+/* Change the period of a repeating timer.  A running timer keeps the
+ * start of its current period, so its next tick comes interval after
+ * the last one (or right away if that has already passed) rather than
+ * restarting the wait every time the stick moves. */
+void timer_set_interval(struct s_timer *timer, timer_type type, void *owner,
+        unsigned long long interval, unsigned long long now)
+{
+    unsigned long long deadline;
+
+    if (timer->heap_index)
+    {
+        if (interval == timer->interval)
+            return;
+        deadline = timer->deadline - timer->interval + interval;
+        if (deadline < now)
+            deadline = now;
+    }
+    else
+    {
+        deadline = now + interval;
+    }
+
+    timer_schedule(timer, type, owner, deadline, interval);
+}
+
+void timer_cancel(struct s_timer *timer)
+{
+    struct s_timer *last;
+
+    if (!timer->heap_index)
+        return;
+
+    last = timer_heap[timer_count--];
+    if (last != timer)
+    {
+        timer_heap_place(last, timer->heap_index);
+        if (last->deadline < timer->deadline)
+            timer_sift_up(last);
+        else
+            timer_sift_down(last);
+    }
+    timer->heap_index = 0;
+}
+
+/* How many times to fire a repeat that is missed repeats late, by the
+ * binding's overrun setting, and set %n for them */
+int repeat_fires(struct s_action *action, int overrun,
+        unsigned long long missed)
+{
+    int fires = 1;
+
+    if (overrun == OVERRUN_COUNT)
+        action_ticks = missed + 1;
+    else if (overrun > 0)
+        fires += missed < overrun ? missed : overrun;
+
+    if (action)
+        action->stats.overruns += missed;
+    repeats_missed += missed;
+    repeats_caught_up += fires - 1;
+    repeats_fired += fires;
+    return fires;
+}
+
+/* Fire every timer that is due.  Each is moved to its next period
+ * before its action runs, so the action may cancel it, and stays in
+ * phase.  Periods missed while we were busy are made up for as the
+ * binding's overrun says: skipped, counted in %n, or caught up. */
+void timers_run()
+{
+    unsigned long long m;
+
+    read(timer_fd, &m, sizeof(m));
+    timer_armed = 0;
+    timers_due(monotonic_ns());
+}
+
+/* Fire the timers due by now, which is the replay's clock when
+ * replaying */
+void timers_due(unsigned long long now)
+{
+    unsigned long long missed;
+    struct s_timer *timer;
+    struct s_axis *axis;
+    struct s_button *button;
+    int fires;
+
+    while (timer_count && timer_heap[1]->deadline <= now)
+    {
+        timer = timer_heap[1];
+        hist_record(HIST_TIMER, now - timer->deadline);
+        action_origin = timer->deadline;
+        if (timer->type == TIMER_FLUSH)
+        {
+            timer_cancel(timer);
+            axis_flush(timer->owner, timer);
+            continue;
+        }
+        missed = (now - timer->deadline) / timer->interval;
+        timer->deadline += timer->interval * (missed + 1);
+        timer_sift_down(timer);
+        action_repeat = 1;
+
+        switch (timer->type)
+        {
+        case TIMER_AXIS:
+            axis = timer->owner;
+            if (axis->config->integrate > 0)
+            {
+                /* Missed ticks are in the sum already */
+                axis_integrate(axis, action_origin);
+                axis_emit(axis, 0);
+                break;
+            }
+            fires = repeat_fires(axis->config->action_on,
+                    axis->config->overrun, missed);
+            while (fires--)
+                send_axis_action(axis, axis->config->action_on);
+            break;
+        case TIMER_BUTTON:
+            button = timer->owner;
+            fires = repeat_fires(button->config->action_on,
+                    button->config->overrun, missed);
+            while (fires--)
+                send_button_action(button, button->config->action_on, 1);
+            break;
+        case TIMER_FLUSH:
+            break;
+        }
+        action_ticks = 1;
+        action_repeat = 0;
+    }
+}
+
+/* Point timer_fd at the earliest deadline, touching it only when that
+ * has changed */
+void timers_arm()
+{
+    struct itimerspec its;
+    unsigned long long deadline = timer_count ? timer_heap[1]->deadline : 0;
+
+    /* A replay runs them on its own clock */
+    if (deadline == timer_armed || replaying)
+        return;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = deadline / 1000000000ULL;
+    its.it_value.tv_nsec = deadline % 1000000000ULL;
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    timer_armed = deadline;
+}
+
+void button_event(struct s_device *dev, int number, int value)
+{
+    struct s_button* button;
+    const struct s_button_config* config;
+
+    if (number >= dev->numbuttons)
+        return;
+    if (value)
+        dev->pressed[number / 64] |= 1ULL << (number % 64);
+    else
+        dev->pressed[number / 64] &= ~(1ULL << (number % 64));
+    if (dev->profile->mode[dev->current_mode].num_combos)
+        combo_event(dev, number, value);
+
+    button = &dev->button[dev->current_mode * dev->numbuttons + number];
+    config = button->config;
+
+    if (value)
+    {
+        button->on = 1;
+
+        if (device_builtin(dev, config->action_on))
+            return;
+
+        if (config->repeat_rate > 0)
+        {
+            unsigned long long interval = config->repeat_rate * 1000000ULL;
+            timer_schedule(&button->timer, TIMER_BUTTON, button,
+                    dev->event_time + interval, interval);
+        }
+
+        send_button_action(button, config->action_on, 1);
+    } 
+    else if (button->on)
+    {
+        button->on = 0;
+
+        timer_cancel(&button->timer);
+
+        if (!device_builtin(dev, config->action_off))
+            send_button_action(button, config->action_off, 0);
+    }
+}
+
+unsigned int chord_hash(const uint64_t *mask)
+{
+    return hash_string((const char *)mask, MASK_WORDS * sizeof(uint64_t));
+}
+
+void combo_send(struct s_device *dev, const struct s_combo *combo,
+        struct s_action *action, int value)
+{
+    if (!action || device_builtin(dev, action) ||
+            !executor_admit(action, combo->config.max_running, value,
+                value ? 1 : -1))
+        return;
+    send_action(action, value, value ? 1 : -1);
+}
+
+/* The chords and sequences of the current mode after a button edge.
+ * The chord held is looked up by hashing the buttons held, and the
+ * sequences move on by one step of their automaton. */
+void combo_event(struct s_device *dev, int number, int value)
+{
+    const struct s_mode *mode = &dev->profile->mode[dev->current_mode];
+    const struct s_automaton *a = &mode->sequences;
+    struct s_combo_state *state = &dev->combo[dev->current_mode];
+    const struct s_combo *chord = state->chord, *combo;
+    int next;
+
+    if (!value)
+    {
+        if (chord && (chord->mask[number / 64] & (1ULL << (number % 64))))
+        {
+            state->chord = NULL;
+            combo_send(dev, chord, chord->config.action_off, 0);
+        }
+        return;
+    }
+
+    if (mode->chord_table_size)
+    {
+        for (combo = mode->chord_table[chord_hash(dev->pressed) &
+                (mode->chord_table_size - 1)]; combo; combo = combo->next_hash)
+            if (!memcmp(combo->mask, dev->pressed, sizeof(combo->mask)))
+                break;
+        if (combo)
+        {
+            if (chord)
+                combo_send(dev, chord, chord->config.action_off, 0);
+            state->chord = combo;
+            combo_send(dev, combo, combo->config.action_on, 1);
+            /* The action may have been @mode */
+            if (state != &dev->combo[dev->current_mode])
+                return;
+        }
+    }
+
+    if (a->num_states)
+    {
+        if (state->state &&
+                dev->event_time - state->last_press > a->timeout[state->state])
+            state->state = 0;
+        state->last_press = dev->event_time;
+        next = number < a->width ? a->next[state->state * a->width + number] : 0;
+        state->state = a->match[next] ? 0 : next;
+        if (a->match[next])
+            combo_send(dev, a->match[next], a->match[next]->config.action_on, 1);
+    }
+}
+
+/* Where the axis's current value is in its curve tables.  An
+ * asymmetric value has had 32767 added already. */
+int curve_index(const struct s_axis *axis)
+{
+    return axis->config->asymmetric ? axis->value + 1 : axis->value + 32768;
+}
+
+
+/* Decide whether an axis event is worth handling, and with what value.
+ * Returns 0 to drop it.  A stick back inside the deadzone or at either
+ * end always gets through, and unsmoothed: no event may follow to bring
+ * the average the rest of the way, and it must still turn off. */
+int axis_filter(struct s_device *dev, struct s_axis *axis, int *value)
+{
+    const struct s_axis_config *config = axis->config;
+    unsigned long long interval;
+    int v = *value, at_rest;
+
+    at_rest = abs(config->asymmetric ? v + 32767 : v) <
+        config->deadzone - config->deadzone_size || v == 0 || abs(v) >= 32767;
+
+    dev->axis_events++;
+    if (config->smoothing && !at_rest)
+        v = axis->smoothed +
+            (v - axis->smoothed) * (100 - config->smoothing) / 100;
+    axis->smoothed = v;
+
+    if (!at_rest && abs(v - axis->passed) < config->min_delta)
+    {
+        dev->small_moves++;
+        return 0;
+    }
+
+    if (config->max_rate)
+    {
+        interval = 1000000000ULL / config->max_rate;
+        if (dev->event_time < axis->passed_at + interval)
+        {
+            /* Hold on to it: if nothing follows it still gets through */
+            axis->pending = v;
+            if (!axis->flush.heap_index)
+                timer_schedule(&axis->flush, TIMER_FLUSH, dev,
+                        axis->passed_at + interval, 0);
+            dev->too_soon++;
+            return 0;
+        }
+        timer_cancel(&axis->flush);
+    }
+
+    axis->passed = v;
+    axis->passed_at = dev->event_time;
+    *value = v;
+    return 1;
+}
+
+/* max_rate's wait for an axis is over: pass on what it held back */
+void axis_flush(struct s_device *dev, struct s_timer *timer)
+{
+    struct s_axis *axis = (struct s_axis *)((char *)timer -
+            offsetof(struct s_axis, flush));
+    int index = axis - dev->axis;
+
+    dev->event_time = timer->deadline;
+    axis->passed = axis->pending;
+    axis->passed_at = dev->event_time;
+    axis_update(dev, axis, axis->pending);
+    if (stream.format)
+        stream_event(dev, JS_EVENT_AXIS, index % dev->numaxes);
+}
+
+void axis_event(struct s_device *dev, int number, int value)
+{
+    struct s_axis* axis;
+    const struct s_axis_config* config;
+
+    if (number >= dev->numaxes)
+        return;
+    axis = &dev->axis[dev->current_mode * dev->numaxes + number];
+    config = axis->config;
+
+    if ((config->smoothing || config->min_delta || config->max_rate) &&
+            !axis_filter(dev, axis, &value))
+        return;
+    axis_update(dev, axis, value);
+}
+
+/* Move an axis to value, and take whatever action that calls for */
+void axis_update(struct s_device *dev, struct s_axis *axis, int value)
+{
+    const struct s_axis_config* config = axis->config;
+
+    /* Sum up the old position for as long as it was held */
+    if (config->integrate > 0 && axis->on)
+        axis_integrate(axis, dev->event_time);
+
+    if (config->asymmetric)
+        axis->value = value + 32767;
+    else
+        axis->value = value;
+    
+
+    if ((abs(axis->value) < config->deadzone - config->deadzone_size) 
+            && axis->on) 
+    {
+        /*turn it off*/
+        axis->on=0;
+
+        timer_cancel(&axis->timer);
+        if (config->integrate > 0)
+            axis_emit(axis, 1);
+
+        if (!device_builtin(dev, config->action_off))
+            send_axis_action(axis, config->action_off);
+    }
+    else if ((abs(axis->value) > 
+                config->deadzone + config->deadzone_size) ) 
+    {
+        if (config->integrate > 0)
+        {
+            /* Nothing is sent until there is a sum to send */
+            if (!axis->on)
+            {
+                if (device_builtin(dev, config->action_on))
+                    return;
+                axis->integral = 0;
+                axis->integrated_at = dev->event_time;
+                timer_schedule(&axis->timer, TIMER_AXIS, axis,
+                        dev->event_time + config->integrate * 1000000ULL,
+                        config->integrate * 1000000ULL);
+            }
+            axis->on = 1;
+            return;
+        }
+
+        if (!axis->on ||
+            (config->repeat && config->repeat_rate_low == 0 &&
+                    config->repeat_rate_high == 0))
+        {
+            /* The mode this axis belongs to may no longer be active */
+            if (device_builtin(dev, config->action_on))
+                return;
+            send_axis_action(axis, config->action_on);
+        }
+
+        if (config->repeat && (config->repeat_rate_low != 0 || 
+                  config->repeat_rate_high != 0)) {
+
+            int ms = config->rate_table[curve_index(axis)];
+
+            if (ms > 0)
+                timer_set_interval(&axis->timer, TIMER_AXIS, axis,
+                        ms * 1000000ULL, dev->event_time);
+            else
+                timer_cancel(&axis->timer);
+        }
+
+        axis->on=1;
+    }
+}
+
+/* Add %v for the time since the last sum to the integral */
+void axis_integrate(struct s_axis *axis, unsigned long long now)
+{
+    if (now <= axis->integrated_at)
+        return;
+    axis->integral += (long long)axis->config->output_table[curve_index(axis)] *
+        (long long)(now - axis->integrated_at);
+    axis->integrated_at = now;
+}
+
+/* Send action_on with the whole units of %v-seconds summed so far,
+ * keeping the fraction for the next time, or with all rounded to the
+ * nearest unit as the stick comes back to the centre.  What isn't
+ * allowed to run now stays in the sum. */
+void axis_emit(struct s_axis *axis, int all)
+{
+    struct s_action *action = axis->config->action_on;
+    long long amount = axis->integral / 1000000000LL;
+
+    if (all)
+    {
+        amount = (axis->integral + (axis->integral < 0 ? -500000000LL :
+                    500000000LL)) / 1000000000LL;
+        axis->integral = 0;
+    }
+    if (!amount || !action || action->builtin == BUILTIN_MODE ||
+            (!action->sink &&
+             executor_full(action, axis->config->max_running)))
+        return;
+
+    if (!all)
+        axis->integral -= amount * 1000000000LL;
+    send_action(action, amount, amount < 0 ? -1 : 1);
+}
+
+/* Longest text %v can produce: "-2147483648" */
+#define MAX_VALUE_LEN 11
+
+/* Split text into literal runs and %v/%s/%n slots.  Any other %
+ * sequence is kept as it is written. */
+void compile_template(struct s_template *template, const char *text, int len)
+{
+    const char *p = text, *end = text + len, *literal = text;
+    struct s_segment *segment;
+
+    /* Every slot splits a literal, so this is the most there can be */
+    template->segments = malloc(sizeof(struct s_segment) * (len + 1));
+    template->num_segments = 0;
+    template->max_len = 0;
+
+    while (p <= end)
+    {
+        segment_type type = SEGMENT_LITERAL;
+
+        if (p < end - 1 && *p == '%' && p[1] == 'v')
+            type = SEGMENT_VALUE;
+        else if (p < end - 1 && *p == '%' && p[1] == 's')
+            type = SEGMENT_SIGN;
+        else if (p < end - 1 && *p == '%' && p[1] == 'n')
+            type = SEGMENT_COUNT;
+        else if (p < end)
+        {
+            p++;
+            continue;
+        }
+
+        if (p > literal)
+        {
+            segment = &template->segments[template->num_segments++];
+            segment->type = SEGMENT_LITERAL;
+            segment->text = literal;
+            segment->len = p - literal;
+            template->max_len += segment->len;
+        }
+        if (type != SEGMENT_LITERAL)
+        {
+            segment = &template->segments[template->num_segments++];
+            segment->type = type;
+            template->max_len += type == SEGMENT_SIGN ? 2 : MAX_VALUE_LEN;
+        }
+        p += 2;
+        literal = p;
+    }
+}
+
+/* Write value in decimal at buffer, returns the length */
+int format_int(char *buffer, int value)
+{
+    char digits[MAX_VALUE_LEN];
+    unsigned int v = value < 0 ? -(unsigned int)value : value;
+    int n = 0, len = 0;
+
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+
+    if (value < 0)
+        buffer[len++] = '-';
+    while (n)
+        buffer[len++] = digits[--n];
+    return len;
+}
+
+/* Fill in a template.  Returns the length written to buffer (which is
+ * also NUL terminated) or -1 if it could be longer than size allows. */
+int expand_template(struct s_template *template, int value, int sign,
+        char *buffer, int size)
+{
+    struct s_segment *segment = template->segments;
+    struct s_segment *end = segment + template->num_segments;
+    char *p = buffer;
+
+    if (template->max_len >= size)
+        return -1;
+
+    for (; segment < end; segment++)
+    {
+        switch (segment->type)
+        {
+        case SEGMENT_LITERAL:
+            memcpy(p, segment->text, segment->len);
+            p += segment->len;
+            break;
+        case SEGMENT_VALUE:
+            p += format_int(p, value);
+            break;
+        case SEGMENT_SIGN:
+            *p++ = sign < 0 ? '-' : '+';
+            *p++ = '1';
+            break;
+        case SEGMENT_COUNT:
+            p += format_int(p, action_ticks);
+            break;
+        }
+    }
+    *p = '\0';
+    return p - buffer;
+}
+
+/* An action that expands to more than MAX_ACTION_STRING isn't run: say which */
+void action_too_long(const char *command)
+{
+    log_warning("Error: action too long, not run: %.*s",
+            (int)strcspn(command, "\n"), command);
+}
+
+/* Expand action with the given %v and %s and start it */
+void send_action(struct s_action *action, int value, int sign)
+{
+	char buffer[MAX_ACTION_STRING];
+    unsigned long long start = monotonic_ns(), expanded;
+
+    action->stats.sent++;
+    if (action->sink)
+    {
+        if (sink_send(action, value, sign))
+            action->stats.dropped++;
+        else
+            action_launched(action, start, start);
+        return;
+    }
+
+    if (action->argv)
+    {
+        /* Only the words with a substitution need to be rebuilt */
+        char *argv[MAX_ACTION_ARGS + 1];
+        char *p_buffer = buffer;
+        int i, len;
+
+        for (i = 0; action->argv[i]; i++)
+        {
+            if (action->argv_templates[i].num_segments == 1 &&
+                    action->argv_templates[i].segments[0].type ==
+                    SEGMENT_LITERAL)
+            {
+                argv[i] = action->argv[i];
+                continue;
+            }
+            len = expand_template(&action->argv_templates[i], value, sign,
+                    p_buffer, buffer + sizeof(buffer) - p_buffer);
+            if (len < 0)
+            {
+                action_too_long(action->command);
+                return;
+            }
+            argv[i] = p_buffer;
+            p_buffer += len + 1;
+        }
+        argv[i] = NULL;
+
+#if DEBUG
+        printf("Action (direct): %s\n", action->command);
+#endif
+        expanded = monotonic_ns();
+        if (executor_spawn(action, argv) == 0)
+        {
+            action_launched(action, start, expanded);
+            return;
+        }
+    }
+
+    if (expand_template(&action->template, value, sign, buffer,
+                sizeof(buffer)) < 0)
+    {
+        action_too_long(action->command);
+        return;
+    }
+
+#if DEBUG
+    printf("Action: %s\n", buffer);
+#endif
+    expanded = monotonic_ns();
+    if (executor_run(action, buffer))
+        action->stats.failed++;
+    else
+        action_launched(action, start, expanded);
+}
+
+/* Record the stage timings of an action that has just been started */
+void action_launched(struct s_action *action, unsigned long long start,
+        unsigned long long expanded)
+{
+    unsigned long long now = monotonic_ns();
+
+    action->stats.launched++;
+    hist_record(HIST_EXPAND, expanded - start);
+    hist_record(HIST_LAUNCH, now - expanded);
+    hist_record(HIST_LATENCY, now > action_origin ? now - action_origin : 0);
+}
+
+void send_axis_action(struct s_axis *axis, struct s_action *action)
+{
+    int value, sign;
+
+	if (!action || action->builtin == BUILTIN_MODE)
+        return;
+
+    value = axis->config->output_table[curve_index(axis)];
+    sign = axis->value < 0 ? -1 : 1;
+    if (executor_admit(action, axis->config->max_running, value, sign))
+        send_action(action, value, sign);
+}
+
+/* For buttons %v is 1 while pressed and 0 on release, %s +1 or -1 */
+void send_button_action(struct s_button *button, struct s_action *action,
+        int value)
+{
+    if (!action || action->builtin == BUILTIN_MODE ||
+            !executor_admit(action, button->config->max_running, value,
+                value ? 1 : -1))
+        return;
+
+    send_action(action, value, value ? 1 : -1);
+}
+
+/* Parse a builtin action: @mode N, @mode next or @mode prev, or
+ * @unix:PATH, @fifo:PATH or @fd:N followed by the message to write.
+ * Returns what is wrong with it if it isn't one. */
+const char *compile_builtin(struct s_action *action)
+{
+    char name[16], arg[16], extra;
+    const char *target, *message;
+    int n;
+
+    if (sscanf(action->command, "@%15[a-z]%c", name, &extra) == 2 &&
+            extra == ':')
+    {
+        target = action->command + strlen(name) + 2;
+        message = target + strcspn(target, " \t");
+        n = message - target;
+        while (*message == ' ' || *message == '\t')
+            message++;
+
+        action->builtin = BUILTIN_SINK;
+        if (n == 0)
+            action->sink = NULL;
+        else if (!strcmp(name, "unix") &&
+                n < sizeof(((struct sockaddr_un *)0)->sun_path))
+            action->sink = sink_find(SINK_UNIX, intern(target, n));
+        else if (!strcmp(name, "fifo"))
+            action->sink = sink_find(SINK_FIFO, intern(target, n));
+        else if (!strcmp(name, "fd") && strspn(target, "0123456789") == n)
+            action->sink = sink_find(SINK_FD, intern(target, n));
+
+        if (!action->sink)
+            return "bad sink";
+        free(action->template.segments);
+        compile_template(&action->template, message, strlen(message));
+        return NULL;
+    }
+
+    n = sscanf(action->command, "@%15s %15s %c", name, arg, &extra);
+    if (n == 2 && !strcmp(name, "mode"))
+    {
+        action->builtin = BUILTIN_MODE;
+        if (!strcmp(arg, "next"))
+            action->mode_step = 1;
+        else if (!strcmp(arg, "prev"))
+            action->mode_step = -1;
+        else if (sscanf(arg, "%d%c", &action->mode, &extra) != 1 ||
+                action->mode < 0 || action->mode >= MAX_MODES)
+            n = 0;
+    }
+    else
+        n = 0;
+
+    return n ? NULL : "unknown builtin";
+}
+
+/* Split command into an argv at config time if it is nothing more than
+ * words separated by blanks, so events can skip the shell entirely.
+ * Returns NULL, and what is wrong in error, if it is a builtin with a
+ * mistake in it. */
+struct s_action *compile_action(const char *command, const char **error)
+{
+    const char *problem;
+    struct s_action *action;
+    char *words, *word, *save;
+    int i, argc = 0;
+    size_t len;
+
+    action = calloc(1, sizeof(struct s_action));
+
+    /* fgets leaves the newline on the end */
+    len = strlen(command);
+    while (len > 0 && isspace((unsigned char)command[len - 1]))
+        len--;
+    action->command = intern(command, len);
+    compile_template(&action->template, action->command, len);
+
+    if (action->command[0] == '@')
+    {
+        if ((problem = compile_builtin(action)))
+        {
+            if (error)
+                *error = problem;
+            action_free(action);
+            return NULL;
+        }
+        return action;
+    }
+
+    if (len == 0 || strpbrk(action->command, SHELL_METACHARS))
+        return action;
+
+    words = strdup(action->command);
+    action->argv = malloc(sizeof(char *) * (MAX_ACTION_ARGS + 1));
+    for (word = strtok_r(words, " \t", &save); word;
+            word = strtok_r(NULL, " \t", &save))
+    {
+        if (argc == MAX_ACTION_ARGS)
+        {
+            argc = 0;
+            break;
+        }
+        action->argv[argc++] = (char *)intern(word, strlen(word));
+    }
+    action->argv[argc] = NULL;
+    free(words);
+
+    if (argc == 0)
+    {
+        free(action->argv);
+        action->argv = NULL;
+    }
+    else
+    {
+        action->argv_templates = malloc(sizeof(struct s_template) * argc);
+        for (i = 0; i < argc; i++)
+            compile_template(&action->argv_templates[i], action->argv[i],
+                    strlen(action->argv[i]));
+    }
+
+#if DEBUG
+    printf("Action %s: %s\n", action->argv ? "direct" : "shell", command);
+#endif
+    return action;
+}
+
+unsigned int hash_string(const char *text, size_t len)
+{
+    unsigned int hash = 2166136261u;
+
+    while (len--)
+        hash = (hash ^ (unsigned char)*text++) * 16777619u;
+    return hash;
+}
+
+/* Store text (which need not be terminated) in the arena, or return the
+ * copy that is already there */
+const char *intern(const char *text, size_t len)
+{
+    struct s_arena_chunk *chunk = strings.chunks;
+    size_t slot, i;
+    char *copy;
+
+    if (strings.count * 2 >= strings.table_size)
+    {
+        /* Grow and rehash */
+        const char **old = strings.table;
+        size_t old_size = strings.table_size;
+
+        strings.table_size = old_size ? old_size * 2 : 256;
+        strings.table = calloc(strings.table_size, sizeof(char *));
+        for (i = 0; i < old_size; i++)
+        {
+            if (!old[i])
+                continue;
+            slot = hash_string(old[i], strlen(old[i])) &
+                (strings.table_size - 1);
+            while (strings.table[slot])
+                slot = (slot + 1) & (strings.table_size - 1);
+            strings.table[slot] = old[i];
+        }
+        free(old);
+    }
+
+    slot = hash_string(text, len) & (strings.table_size - 1);
+    while (strings.table[slot])
+    {
+        if (!strncmp(strings.table[slot], text, len) &&
+                strings.table[slot][len] == '\0')
+        {
+            strings.saved += len + 1;
+            return strings.table[slot];
+        }
+        slot = (slot + 1) & (strings.table_size - 1);
+    }
+
+    if (!chunk || chunk->size - chunk->used < len + 1)
+    {
+        size_t size = len + 1 > ARENA_CHUNK ? len + 1 : ARENA_CHUNK;
+        chunk = malloc(sizeof(struct s_arena_chunk) + size);
+        chunk->size = size;
+        chunk->used = 0;
+        chunk->next = strings.chunks;
+        strings.chunks = chunk;
+        strings.bytes += size;
+    }
+
+    copy = chunk->data + chunk->used;
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    chunk->used += len + 1;
+
+    strings.table[slot] = copy;
+    strings.count++;
+    return copy;
+}
+
+/* The sink for target, made if it is new */
+struct s_sink *sink_find(sink_type type, const char *target)
+{
+    struct s_sink *sink;
+
+    /* target is interned, so the same text is the same pointer */
+    for (sink = sinks; sink; sink = sink->next)
+        if (sink->type == type && sink->target == target)
+            return sink;
+
+    sink = calloc(1, sizeof(struct s_sink));
+    sink->type = type;
+    sink->target = target;
+    sink->fd = -1;
+    sink->next = sinks;
+    sinks = sink;
+    return sink;
+}
+
+int sink_connect(const char *path, int type)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if ((fd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Open sink unless it failed too recently.  Writes never block: a
+ * reader that falls behind loses messages rather than stalling input. */
+int sink_open(struct s_sink *sink)
+{
+    unsigned long long now = monotonic_ns();
+
+    if (now < sink->retry_at)
+        return -1;
+
+    switch (sink->type)
+    {
+    case SINK_UNIX:
+        sink->fd = sink_connect(sink->target, SOCK_STREAM);
+        if (sink->fd == -1 && errno == EPROTOTYPE)
+            sink->fd = sink_connect(sink->target, SOCK_DGRAM);
+        break;
+    case SINK_FIFO:
+        /* Fails with ENXIO until something opens the other end */
+        sink->fd = open(sink->target, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        break;
+    case SINK_FD:
+        sink->fd = sink_open_fd(sink);
+        break;
+    }
+
+    if (sink->fd == -1)
+    {
+        if (!sink->failed)
+            printf("Can't open sink %s: %s\n", sink->target, strerror(errno));
+        sink->failed = 1;
+        sink->retry_at = now + SINK_RETRY_NS;
+        return -1;
+    }
+    sink->failed = 0;
+    return 0;
+}
+
+/* An @fd: sink writes through a descriptor of its own, as O_NONBLOCK on
+ * the inherited one would change the shell's I/O too.  A pipe or
+ * terminal is opened again through /proc; a socket is dup()ed and sent
+ * to with MSG_DONTWAIT, and a file, which never blocks, dup()ed. */
+int sink_open_fd(struct s_sink *sink)
+{
+    char path[32];
+    struct stat st;
+    int fd = atoi(sink->target), flags;
+
+    if (fstat(fd, &st) == -1 || (flags = fcntl(fd, F_GETFL)) == -1)
+        return -1;
+    sink->is_socket = S_ISSOCK(st.st_mode);
+    if (sink->is_socket || S_ISREG(st.st_mode))
+        return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    return open(path, O_WRONLY | (flags & O_APPEND) | O_NONBLOCK |
+            O_NOCTTY | O_CLOEXEC);
+}
+
+ssize_t sink_write(struct s_sink *sink, const char *buffer, size_t len)
+{
+    if (sink->is_socket)
+        return send(sink->fd, buffer, len, MSG_DONTWAIT);
+    return write(sink->fd, buffer, len);
+}
+
+void sink_close(struct s_sink *sink)
+{
+    if (sink->fd != -1)
+        close(sink->fd);
+    sink->fd = -1;
+    sink->pending_len = 0;
+}
+
+/* Write what is left of a partly written line.  Returns -1 if some of
+ * it is still left, or the sink had to be closed. */
+int sink_flush(struct s_sink *sink)
+{
+    ssize_t n;
+
+    if (!sink->pending_len)
+        return 0;
+    n = sink_write(sink, sink->pending, sink->pending_len);
+    if (n < 0 && errno != EAGAIN)
+    {
+        /* Gone: the caller sees fd -1 and may reconnect */
+        sink_close(sink);
+        return -1;
+    }
+    if (n > 0)
+    {
+        sink->pending_len -= n;
+        memmove(sink->pending, sink->pending + n, sink->pending_len);
+    }
+    return sink->pending_len ? -1 : 0;
+}
+
+/* Finish off partly written lines while there is nothing new to send */
+void sinks_flush()
+{
+    struct s_sink *sink;
+
+    for (sink = sinks; sink; sink = sink->next)
+        if (sink->pending_len)
+            sink_flush(sink);
+}
+
+/* Write action's message as one line to its sink, reconnecting once if
+ * the other end has gone.  Returns -1 if the line was dropped. */
+int sink_send(struct s_action *action, int value, int sign)
+{
+    struct s_sink *sink = action->sink;
+	char buffer[MAX_ACTION_STRING];
+    int len, tries;
+    ssize_t n;
+
+    len = expand_template(&action->template, value, sign, buffer,
+            sizeof(buffer) - 1);
+    if (len < 0)
+    {
+        action_too_long(action->command);
+        return -1;
+    }
+    buffer[len++] = '\n';
+
+#if DEBUG
+    printf("Sink %s: %.*s", sink->target, len, buffer);
+#endif
+    for (tries = 0; tries < 2; tries++)
+    {
+        if (sink->fd == -1 && sink_open(sink))
+            break;
+
+        /* Until the last line is out this one would break into it */
+        if (sink_flush(sink))
+        {
+            if (sink->fd == -1)
+                continue;
+            break;
+        }
+
+        n = sink_write(sink, buffer, len);
+        if (n > 0 && n < len)
+        {
+            if (!sink->pending)
+                sink->pending = malloc(MAX_ACTION_STRING);
+            memcpy(sink->pending, buffer + n, len - n);
+            sink->pending_len = len - n;
+        }
+        if (n > 0)
+        {
+            sink->sent++;
+            return 0;
+        }
+        /* A full buffer means the reader is slow, not gone */
+        if (n == 0 || errno == EAGAIN)
+            break;
+        sink_close(sink);
+    }
+    sink->dropped++;
+    return -1;
+}
+
+/* Set up the stream: a listening socket, or stdout.  The output of
+ * everything else, ours and the actions', moves to stderr so it can't
+ * get mixed into the stream; anything already waiting in stdout's
+ * buffer goes there too. */
+int stream_init()
+{
+    struct sockaddr_un addr;
+    static struct s_watch stream_watch;
+    int fd, flags;
+
+    if (!stream.path)
+    {
+        if ((fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3)) == -1 ||
+                dup2(STDERR_FILENO, STDOUT_FILENO) == -1 ||
+                (flags = fcntl(fd, F_GETFL)) == -1 ||
+                fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+            return -1;
+        stream.subscribers[stream.num_subscribers++] = fd;
+        return 0;
+    }
+
+    if (strlen(stream.path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, stream.path);
+    unlink(stream.path);
+
+    stream.listen_fd = socket(AF_UNIX,
+            SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (stream.listen_fd == -1 ||
+            bind(stream.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+            listen(stream.listen_fd, MAX_SUBSCRIBERS) ||
+            watch_add(stream.listen_fd, &stream_watch, WATCH_STREAM, NULL))
+        return -1;
+    return 0;
+}
+
+void stream_accept()
+{
+    /* Enough to ride out a burst from every device at once */
+    int fd, size = 16 * STREAM_BUFFER;
+
+    while ((fd = accept4(stream.listen_fd, NULL, NULL,
+                    SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+    {
+        if (stream.num_subscribers == MAX_SUBSCRIBERS)
+        {
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        stream.subscribers[stream.num_subscribers++] = fd;
+    }
+}
+
+/* Room for size more bytes of records, flushing early if need be */
+char *stream_reserve(int size)
+{
+    if (stream.len + size > STREAM_BUFFER)
+        stream_flush();
+    return stream.buffer + stream.len;
+}
+
+void stream_record(struct s_device *dev, unsigned long long time, int type,
+        int number, int on, int value)
+{
+    struct s_stream_record *record;
+    const char *name;
+    char *p;
+
+    if (stream.format == STREAM_BINARY)
+    {
+        record = (struct s_stream_record *)stream_reserve(sizeof(*record));
+        memset(record, 0, sizeof(*record));
+        record->time = time;
+        record->device = dev->id;
+        record->type = type;
+        record->number = number;
+        record->on = on;
+        record->value = value;
+        stream.len += sizeof(*record);
+        return;
+    }
+
+    name = type == JS_EVENT_AXIS ? "axis" : "button";
+    p = stream_reserve(128);
+    stream.len += snprintf(p, 128, "{\"time\":%llu,\"device\":%d,"
+            "\"type\":\"%s\",\"number\":%d,\"on\":%d,\"value\":%d}\n",
+            time, dev->id, name, number, on, value);
+}
+
+/* Publish the state an event left axis or button number in */
+void stream_event(struct s_device *dev, int type, int number)
+{
+    struct s_axis *axis;
+    struct s_button *button;
+
+    if (type == JS_EVENT_AXIS && number < dev->numaxes)
+    {
+        axis = &dev->axis[dev->current_mode * dev->numaxes + number];
+        stream_record(dev, dev->event_time, type, number, axis->on,
+                axis->on ? axis->value : 0);
+    }
+    else if (type == JS_EVENT_BUTTON && number < dev->numbuttons)
+    {
+        button = &dev->button[dev->current_mode * dev->numbuttons + number];
+        stream_record(dev, dev->event_time, type, number, button->on,
+                button->on);
+    }
+}
+
+/* Append text to the stream as a JSON string.  The caller has made
+ * room for it, escaped. */
+void stream_json_string(const char *text)
+{
+    char *p = stream.buffer + stream.len;
+
+    *p++ = '"';
+    for (; *text; text++)
+    {
+        if (*text == '"' || *text == '\\')
+            *p++ = '\\';
+        if ((unsigned char)*text >= ' ')
+            *p++ = *text;
+    }
+    *p++ = '"';
+    stream.len = p - stream.buffer;
+}
+
+/* Tell subscribers a device has come or gone.  The binary record has
+ * only its number; JSON has its path and name too. */
+void stream_device(struct s_device *dev, int type)
+{
+    const char *name = type == STREAM_ATTACH ? "attach" : "detach";
+
+    if (stream.format == STREAM_BINARY)
+    {
+        stream_record(dev, monotonic_ns(), type, 0, type == STREAM_ATTACH, 0);
+        return;
+    }
+
+    stream_reserve(2 * MAX_DEVICE_NAME + 2 * PATH_MAX + 128);
+    stream.len += sprintf(stream.buffer + stream.len,
+            "{\"time\":%llu,\"device\":%d,\"type\":\"%s\",\"path\":",
+            monotonic_ns(), dev->id, name);
+    stream_json_string(dev->path);
+    stream.len += sprintf(stream.buffer + stream.len, ",\"name\":");
+    stream_json_string(dev->name);
+    stream.len += sprintf(stream.buffer + stream.len, "}\n");
+}
+
+/* Write out everything gathered since the last flush */
+void stream_flush()
+{
+    int i;
+
+    if (stream.len == 0)
+        return;
+
+    for (i = 0; i < stream.num_subscribers; )
+    {
+        if (write(stream.subscribers[i], stream.buffer, stream.len) ==
+                stream.len)
+        {
+            i++;
+            continue;
+        }
+
+        /* Too slow or gone: a partial record can't be taken back */
+        close(stream.subscribers[i]);
+        stream.subscribers[i] = stream.subscribers[--stream.num_subscribers];
+        stream.dropped++;
+        fprintf(stderr, "Dropped stream subscriber, %d left\n",
+                stream.num_subscribers);
+    }
+    stream.len = 0;
+}
+
+int record_open(const char *path)
+{
+    if (!(record_file = fopen(path, "we")))
+        return -1;
+    setvbuf(record_file, NULL, _IOFBF, STREAM_BUFFER);
+    fwrite(LOG_MAGIC, 1, strlen(LOG_MAGIC), record_file);
+    record_start = monotonic_ns();
+    return 0;
+}
+
+void record_device(struct s_device *dev, int type)
+{
+    struct s_log_record record;
+    size_t path_len = strlen(dev->path) + 1;
+    size_t name_len = strlen(dev->name) + 1;
+
+    if (type == LOG_ATTACH)
+    {
+        for (dev->log_id = 0; dev->log_id < 256 &&
+                record_ids_used[dev->log_id]; dev->log_id++)
+            ;
+        if (dev->log_id == 256)
+        {
+            log_warning("Not recording %s: 256 devices are attached",
+                    dev->path);
+            dev->log_id = -1;
+            return;
+        }
+        record_ids_used[dev->log_id] = 1;
+    }
+    if (dev->log_id == -1)
+        return;
+
+    memset(&record, 0, sizeof(record));
+    record.time = monotonic_ns() - record_start;
+    record.device = dev->log_id;
+    record.type = type;
+    if (type == LOG_ATTACH)
+    {
+        record.number = dev->numaxes;
+        record.extra = dev->numbuttons;
+        record.len = path_len + name_len;
+    }
+    fwrite(&record, sizeof(record), 1, record_file);
+    if (type == LOG_ATTACH)
+    {
+        fwrite(dev->path, 1, path_len, record_file);
+        fwrite(dev->name, 1, name_len, record_file);
+    }
+    else
+    {
+        record_ids_used[dev->log_id] = 0;
+    }
+}
+
+/* Log one batch of events as it was read, so a replay batches and
+ * coalesces them the same way */
+void record_events(struct s_device *dev, struct js_event *js, int count)
+{
+    struct s_log_record record;
+    int i;
+
+    if (dev->log_id == -1)
+        return;
+    memset(&record, 0, sizeof(record));
+    record.time = dev->event_time > record_start ?
+        dev->event_time - record_start : 0;
+    record.device = dev->log_id;
+    for (i = 0; i < count; i++)
+    {
+        record.type = js[i].type;
+        record.number = js[i].number;
+        record.value = js[i].value;
+        record.extra = i == count - 1;
+        fwrite(&record, sizeof(record), 1, record_file);
+    }
+}
+
+/* Wait until the real time that time on the replay's clock, which
+ * started at start, stands for at replay_speed; with 0, don't wait */
+void replay_wait(unsigned long long start, unsigned long long time)
+{
+    unsigned long long target, now;
+
+    if (replay_speed <= 0)
+        return;
+    target = start + (time - start) / replay_speed;
+    while ((now = monotonic_ns()) < target)
+        handle_events((target - now + 999999) / 1000000);
+}
+
+/* Move the replay's clock on to until, firing the timers due before
+ * then at their own deadlines */
+void replay_advance(unsigned long long start, unsigned long long until)
+{
+    unsigned long long next;
+
+    do
+    {
+        next = timer_count && timer_heap[1]->deadline < until ?
+            timer_heap[1]->deadline : until;
+        replay_wait(start, next);
+        timers_due(next);
+        handle_events(0);
+    } while (next < until);
+}
+
+/* Feed a log through the same path as live events, on the devices it
+ * was recorded from, then wait for the actions to finish.  Everything
+ * runs on a clock of the replay's own that follows the recorded times,
+ * so repeats fire as they did live at any speed.  It keeps to real time
+ * divided by replay_speed, or doesn't wait at all if that is 0;
+ * children are serviced in between. */
+int replay_run(const char *path)
+{
+    struct s_device *replay_devices[256] = {NULL};
+    struct s_device *dev;
+    struct s_log_record record;
+    struct js_event js[JS_EVENT_BATCH];
+    char names[2 * PATH_MAX];
+    unsigned long long start, now, events = 0, dispatch_ns = 0;
+    long long total_us;
+    struct timespec begin;
+    FILE *file;
+    int count = 0, i;
+
+    if (!(file = fopen(path, "re")))
+        return -1;
+    if (!fgets(names, sizeof(names), file) || strcmp(names, LOG_MAGIC))
+    {
+        printf("%s is not a joy2script log\n", path);
+        fclose(file);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    start = monotonic_ns();
+    replaying = 1;
+    while (fread(&record, sizeof(record), 1, file) == 1)
+    {
+        dev = replay_devices[record.device];
+        if (record.type == LOG_ATTACH || record.type == LOG_DETACH)
+            replay_advance(start, start + record.time);
+
+        switch (record.type)
+        {
+        case LOG_ATTACH:
+            if (record.len > sizeof(names) ||
+                    fread(names, 1, record.len, file) != record.len ||
+                    names[record.len - 1] != '\0')
+                goto truncated;
+            if (dev)
+                device_detach(dev);
+
+            /* Stands in for the device: something to close on detach */
+            dev = calloc(1, sizeof(struct s_device));
+            dev->fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            dev->backend = backend;
+            dev->path = strdup(names);
+            strncpy(dev->name, names + strlen(names) + 1,
+                    MAX_DEVICE_NAME - 1);
+            dev->numaxes = record.number;
+            dev->numbuttons = record.extra;
+            dev->id = next_device_id++;
+            replay_devices[record.device] = device_add(dev);
+            continue;
+        case LOG_DETACH:
+            if (dev)
+                device_detach(dev);
+            replay_devices[record.device] = NULL;
+            continue;
+        }
+
+        if (!dev || count == JS_EVENT_BATCH)
+            goto truncated;
+        js[count].time = record.time / 1000000;
+        js[count].type = record.type;
+        js[count].number = record.number;
+        js[count].value = record.value;
+        count++;
+        if (!record.extra)
+            continue;
+
+        replay_advance(start, start + record.time);
+
+        now = monotonic_ns();
+        dev->event_time = start + record.time;
+        dispatch_events(dev, js, count);
+        dispatch_ns += monotonic_ns() - now;
+        events += count;
+        count = 0;
+    }
+    fclose(file);
+
+    for (i = 0; i < 256; i++)
+        if (replay_devices[i])
+            device_detach(replay_devices[i]);
+    while (running_jobs)
+        handle_events(-1);
+    handle_events(0);
+
+    total_us = elapsed_us(&begin);
+    printf("Replayed %llu events in %lld us (%lld/s), %llu us of it "
+            "dispatching (%llu ns/event)\n", events, total_us,
+            total_us ? events * 1000000LL / total_us : 0,
+            dispatch_ns / 1000, events ? dispatch_ns / events : 0);
+    return 0;
+
+truncated:
+    printf("%s is truncated or corrupt\n", path);
+    fclose(file);
+    return -1;
+}
+
+/* Executor: actions are handed to a pool of warm shells instead of
+ * paying fork + exec("/bin/sh") + shell startup in system() for every
+ * event.  Each worker runs the loop below; the command is eval'd in a
+ * subshell so "exit", "cd" or a syntax error can't damage the worker,
+ * and its stdin is /dev/null so it can't swallow the commands queued 
+ * behind it. */
+#define WORKER_SCRIPT \
+    "while IFS= read -r j2s_cmd; do " \
+    "(eval \"$j2s_cmd\") </dev/null; echo $? >&3; done"
+
+int worker_start(struct s_worker *worker)
+{
+    int cmd_pipe[2], done_pipe[2];
+    sigset_t sigchld;
+
+    if (pipe2(cmd_pipe, O_CLOEXEC))
+        return -1;
+    if (pipe2(done_pipe, O_CLOEXEC | O_NONBLOCK))
+    {
+        close(cmd_pipe[0]);
+        close(cmd_pipe[1]);
+        return -1;
+    }
+
+    worker->pid = fork();
+    if (worker->pid == 0)
+    {
+        /* dup2 clears close-on-exec, so only these survive the exec */
+        dup2(cmd_pipe[0], STDIN_FILENO);
+        dup2(done_pipe[1], 3);
+        signal(SIGPIPE, SIG_DFL);
+        sigemptyset(&sigchld);
+        sigaddset(&sigchld, SIGCHLD);
+        sigaddset(&sigchld, SIGUSR1);
+        sigaddset(&sigchld, SIGHUP);
+        sigprocmask(SIG_UNBLOCK, &sigchld, NULL);
+        /* SCHED_RESET_ON_FORK already took the priority away */
+        if (rt_cpu >= 0)
+            sched_setaffinity(0, sizeof(rt_original_cpus), &rt_original_cpus);
+        execl("/bin/sh", "sh", "-c", WORKER_SCRIPT, (char *)NULL);
+        _exit(127);
+    }
+
+    close(cmd_pipe[0]);
+    close(done_pipe[1]);
+
+    if (worker->pid < 0)
+    {
+        close(cmd_pipe[1]);
+        close(done_pipe[0]);
+        return -1;
+    }
+
+    worker->cmd_fd = cmd_pipe[1];
+    worker->done_fd = done_pipe[0];
+    worker->busy = 0;
+
+    if (watch_add(worker->done_fd, &worker->watch, WATCH_WORKER, worker))
+    {
+        kill(worker->pid, SIGTERM);
+        close(worker->cmd_fd);
+        close(worker->done_fd);
+        worker->cmd_fd = worker->done_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void worker_finish(struct s_worker *worker)
+{
+    if (!worker->busy)
+        return;
+    hist_record(HIST_RUN, monotonic_ns() - worker->start);
+    if (worker->action)
+        worker->action->running--;
+    running_jobs--;
+    worker->busy = 0;
+}
+
+/* done_fd is readable: the command has finished, and the worker has
+ * written its exit status */
+void worker_done(struct s_worker *worker)
+{
+    char buf[64];
+    ssize_t n;
+
+    while ((n = read(worker->done_fd, buf, sizeof(buf) - 1)) > 0)
+    {
+        buf[n] = '\0';
+        if (worker->busy && worker->action && atoi(buf) != 0)
+            worker->action->stats.failed++;
+        worker_finish(worker);
+    }
+    executor_drain();
+
+    /* The shell is gone.  Stop listening; SIGCHLD takes it from here */
+    if (n == 0)
+    {
+        close(worker->done_fd);
+        worker->done_fd = -1;
+    }
+}
+
+/* Called once the worker's process has been reaped: release what it was
+ * running and start a replacement */
+void worker_restart(struct s_worker *worker)
+{
+    worker_finish(worker);
+    close(worker->cmd_fd);
+    if (worker->done_fd != -1)
+        close(worker->done_fd);
+    worker->pid = -1;
+    worker->cmd_fd = worker->done_fd = -1;
+
+    if (worker_start(worker))
+        printf("Error restarting worker %d\n", (int)(worker - workers));
+}
+
+/* An idle worker, or NULL */
+struct s_worker *worker_pick()
+{
+    int i;
+
+    for (i = 0; i < num_workers; i++)
+        if (workers[i].cmd_fd != -1 && !workers[i].busy)
+            return &workers[i];
+    return NULL;
+}
+
+int worker_send(struct s_worker *worker, struct s_action *action,
+        const char *line, int len)
+{
+    /* A full pipe means a stuck shell: don't wait for it */
+    if (write(worker->cmd_fd, line, len) != len)
+        return -1;
+
+    worker->action = action;
+    worker->busy = 1;
+    worker->start = monotonic_ns();
+    running_jobs++;
+    if (action)
+        action->running++;
+    return 0;
+}
+
+int executor_init()
+{
+    sigset_t signals;
+    static struct s_watch signal_watch;
+    int i;
+
+    /* SIGCHLD, SIGUSR1 and SIGHUP are only ever read from signal_fd */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGHUP);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1 ||
+            watch_add(signal_fd, &signal_watch, WATCH_SIGNALS, NULL))
+        return -1;
+
+    jobs = calloc(max_children, sizeof(struct s_job));
+    queue = calloc(max_queued, sizeof(struct s_queued));
+
+    if (num_workers > MAX_WORKERS)
+        num_workers = MAX_WORKERS;
+
+    for (i = 0; i < num_workers; i++)
+    {
+        if (worker_start(&workers[i]))
+        {
+            /* Run with what we have; the shell covers the rest */
+            printf("Error starting worker %d, using %d\n", i, i);
+            num_workers = i;
+            break;
+        }
+    }
+    return 0;
+}
+
+/* Whether max_children, or limit copies of action, are running */
+int executor_full(const struct s_action *action, int limit)
+{
+    return running_jobs >= max_children ||
+        (limit > 0 && action->running >= limit);
+}
+
+/* Whether another copy of action may start now.  If not, it is queued
+ * to start when a running one finishes, behind any copies already
+ * waiting.  A repeat with a copy waiting is let go as an overrun, so a
+ * slow action can't pile up stale repeats; a full queue drops it. */
+int executor_admit(struct s_action *action, int limit, int value, int sign)
+{
+    struct s_queued *entry;
+
+    /* Writing to a sink starts nothing */
+    if (action->sink || (!action->queued && !executor_full(action, limit)))
+        return 1;
+
+    if (action_repeat && action->queued)
+    {
+        action->stats.overruns++;
+        return 0;
+    }
+    if (num_queued >= max_queued)
+    {
+        action->stats.dropped++;
+        if (!action->drop_logged)
+        {
+            log_warning("Dropped action, %d running and %d waiting: %.*s",
+                    running_jobs, num_queued,
+                    (int)strcspn(action->command, "\n"), action->command);
+            action->drop_logged = 1;
+        }
+        return 0;
+    }
+
+    entry = &queue[num_queued++];
+    entry->action = action;
+    entry->limit = limit;
+    entry->value = value;
+    entry->sign = sign;
+    entry->ticks = action_ticks;
+    entry->origin = action_origin;
+    action->queued++;
+    return 0;
+}
+
+/* Start what the queue holds, oldest first, as far as the limits now
+ * allow; the rest keep their order */
+void executor_drain()
+{
+    unsigned long long origin = action_origin;
+    int ticks = action_ticks, i, kept = 0;
+    struct s_queued entry;
+
+    for (i = 0; i < num_queued; i++)
+    {
+        entry = queue[i];
+        if (executor_full(entry.action, entry.limit))
+        {
+            queue[kept++] = entry;
+            continue;
+        }
+        entry.action->queued--;
+        action_origin = entry.origin;
+        action_ticks = entry.ticks;
+        send_action(entry.action, entry.value, entry.sign);
+    }
+    num_queued = kept;
+    action_origin = origin;
+    action_ticks = ticks;
+}
+
+/* Run command through the shell: on an idle worker if there is one,
+ * otherwise in a new /bin/sh */
+int executor_run(struct s_action *action, const char *command)
+{
+    char line[MAX_ACTION_STRING + 1];
+    char *argv[] = {"/bin/sh", "-c", NULL, NULL};
+    struct s_worker *worker;
+    int len;
+
+    if (!command)
+        return -1;
+
+    /* One command per line: drop the newline fgets left on the action */
+    len = strcspn(command, "\n");
+    if (len > MAX_ACTION_STRING - 1)
+    {
+        action_too_long(action ? action->command : command);
+        return -1;
+    }
+    memcpy(line, command, len);
+    line[len++] = '\n';
+
+    if ((worker = worker_pick()) && worker_send(worker, action, line, len) == 0)
+        return 0;
+
+    line[len - 1] = '\0';
+    argv[2] = line;
+    return executor_spawn(action, argv);
+}
+
+/* Launch argv without a shell.  posix_spawn uses vfork semantics, so
+ * this costs one process and no copy of our page tables.  Returns -1 if
+ * the program couldn't be started (e.g. it is a shell builtin), in
+ * which case the caller falls back to the shell. */
+int executor_spawn(struct s_action *action, char **argv)
+{
+    pid_t pid;
+    posix_spawnattr_t attr;
+    sigset_t sigdefault, sigmask;
+    int i;
+
+    /* Don't pass our ignored SIGPIPE or blocked SIGCHLD on */
+    sigemptyset(&sigdefault);
+    sigaddset(&sigdefault, SIGPIPE);
+    sigemptyset(&sigmask);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    posix_spawnattr_setsigmask(&attr, &sigmask);
+    posix_spawnattr_setflags(&attr,
+            POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    if (posix_spawnp(&pid, argv[0], NULL, &attr, argv, environ))
+    {
+        posix_spawnattr_destroy(&attr);
+        return -1;
+    }
+    posix_spawnattr_destroy(&attr);
+
+    for (i = 0; i < max_children; i++)
+    {
+        if (jobs[i].pid == 0)
+        {
+            jobs[i].pid = pid;
+            jobs[i].start = monotonic_ns();
+            jobs[i].action = action;
+            break;
+        }
+    }
+    running_jobs++;
+    if (action)
+        action->running++;
+    return 0;
+}
+
+void signals_read()
+{
+    struct signalfd_siginfo si[16];
+    ssize_t n;
+    int i, usr1 = 0, hup = 0;
+
+    while ((n = read(signal_fd, si, sizeof(si))) > 0)
+    {
+        for (i = 0; i < n / sizeof(si[0]); i++)
+        {
+            usr1 |= si[i].ssi_signo == SIGUSR1;
+            hup |= si[i].ssi_signo == SIGHUP;
+        }
+    }
+
+    /* SIGCHLDs merge, so look for exited children whatever came */
+    children_reap();
+    executor_drain();
+    if (usr1)
+        stats_log();
+    if (hup)
+        config_reload();
+}
+
+/* An action is about to be freed: whatever is still running it no
+ * longer counts against it, and copies still waiting won't start */
+void executor_forget(struct s_action *action)
+{
+    int i, kept = 0;
+
+    for (i = 0; i < num_queued; i++)
+        if (queue[i].action != action)
+            queue[kept++] = queue[i];
+    num_queued = kept;
+
+    for (i = 0; i < max_children; i++)
+        if (jobs && jobs[i].action == action)
+            jobs[i].action = NULL;
+    for (i = 0; i < num_workers; i++)
+        if (workers[i].action == action)
+            workers[i].action = NULL;
+}
+
+/* SIGCHLD: collect every child that has exited */
+void children_reap()
+{
+    pid_t pid;
+    int i, status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        for (i = 0; i < num_workers; i++)
+        {
+            if (workers[i].pid == pid)
+            {
+                worker_restart(&workers[i]);
+                break;
+            }
+        }
+        if (i < num_workers)
+            continue;
+
+        for (i = 0; i < max_children; i++)
+        {
+            if (jobs[i].pid == pid)
+            {
+                hist_record(HIST_RUN, monotonic_ns() - jobs[i].start);
+                if (jobs[i].action)
+                {
+                    jobs[i].action->running--;
+                    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                        jobs[i].action->stats.failed++;
+                }
+                jobs[i].pid = 0;
+                running_jobs--;
+                break;
+            }
+        }
+    }
+}
+
+void hist_record(histogram_type type, unsigned long long ns)
+{
+    hist_add(&histograms[type], ns);
+}
+
+void hist_add(struct s_histogram *h, unsigned long long ns)
+{
+    int shift, bucket;
+
+    if (ns < (1 << HIST_SUB_BITS))
+        bucket = ns;
+    else
+    {
+        shift = 63 - __builtin_clzll(ns) - HIST_SUB_BITS;
+        bucket = ((shift + 1) << HIST_SUB_BITS) |
+            ((ns >> shift) & ((1 << HIST_SUB_BITS) - 1));
+    }
+    h->buckets[bucket]++;
+    h->count++;
+    if (ns > h->max)
+        h->max = ns;
+}
+
+/* The smallest value in the bucket holding the given fraction of h */
+unsigned long long hist_percentile(struct s_histogram *h, double fraction)
+{
+    unsigned long long seen = 0, want = fraction * h->count;
+    int bucket, shift;
+
+    for (bucket = 0; bucket < HIST_BUCKETS; bucket++)
+    {
+        seen += h->buckets[bucket];
+        if (seen > want)
+            break;
+    }
+    if (bucket < (1 << HIST_SUB_BITS))
+        return bucket;
+    shift = (bucket >> HIST_SUB_BITS) - 1;
+    return (unsigned long long)((bucket & ((1 << HIST_SUB_BITS) - 1)) |
+            (1 << HIST_SUB_BITS)) << shift;
+}
+
+void stats_action(FILE *out, const char *profile, int mode,
+        const char *control, int number, const char *which,
+        struct s_action *action)
+{
+    struct s_action_stats *s;
+
+    if (!action || !action->stats.sent)
+        return;
+    s = &action->stats;
+    fprintf(out, "%s mode %d %s %d %s: sent %lu launched %lu dropped %lu "
+            "failed %lu overruns %lu\n", profile, mode, control, number,
+            which, s->sent, s->launched, s->dropped, s->failed, s->overruns);
+}
+
+/* Everything there is to know, one line at a time */
+void stats_report(FILE *out)
+{
+    struct s_profile *profile = &bindings->default_profile;
+    struct s_histogram *h;
+    struct s_device *dev;
+    struct s_combo *combo;
+    const char *name, *control;
+    int i, m;
+
+    fprintf(out, "up %llu s, %d actions running, %d waiting\n",
+            (monotonic_ns() - stats_start) / 1000000000ULL, running_jobs,
+            num_queued);
+    for (dev = devices; dev; dev = dev->next)
+        if (dev->fd != -1)
+            fprintf(out, "device %s (%s): mode %d, worst input lag %llu us, "
+                    "%lu axis events, %lu too small, %lu too soon\n",
+                    dev->path, dev->name, dev->current_mode,
+                    dev->lag_max / 1000, dev->axis_events, dev->small_moves,
+                    dev->too_soon);
+    fprintf(out, "repeats: %lu fired, %lu missed, %lu of them caught up\n",
+            repeats_fired, repeats_missed, repeats_caught_up);
+    if (ring.entries)
+        fprintf(out, "input ring: %u entries, at most %u queued, "
+                "%lu events dropped\n", ring.size,
+                __atomic_load_n(&ring.high_water, __ATOMIC_RELAXED),
+                __atomic_load_n(&ring.overflows, __ATOMIC_RELAXED));
+
+    for (i = 0; i < NUM_HISTOGRAMS; i++)
+    {
+        h = &histograms[i];
+        fprintf(out, "%-15s %8llu times, us p50 %llu p90 %llu p99 %llu "
+                "p99.9 %llu max %llu\n", h->name, h->count,
+                hist_percentile(h, 0.5) / 1000,
+                hist_percentile(h, 0.9) / 1000,
+                hist_percentile(h, 0.99) / 1000,
+                hist_percentile(h, 0.999) / 1000, h->max / 1000);
+    }
+
+    while (profile)
+    {
+        name = profile->match ? profile->match : "default";
+        for (m = 0; m < profile->num_modes; m++)
+        {
+            for (combo = profile->mode[m].combos, i = 0; combo;
+                    combo = combo->next, i++)
+            {
+                control = combo->length ? "sequence" : "chord";
+                stats_action(out, name, m, control, i, "on",
+                        combo->config.action_on);
+                stats_action(out, name, m, control, i, "off",
+                        combo->config.action_off);
+            }
+            for (i = 0; i < profile->mode[m].num_axes; i++)
+            {
+                stats_action(out, name, m, "axis", i, "on",
+                        profile->mode[m].axis[i].action_on);
+                stats_action(out, name, m, "axis", i, "off",
+                        profile->mode[m].axis[i].action_off);
+            }
+            for (i = 0; i < profile->mode[m].num_buttons; i++)
+            {
+                stats_action(out, name, m, "button", i, "on",
+                        profile->mode[m].button[i].action_on);
+                stats_action(out, name, m, "button", i, "off",
+                        profile->mode[m].button[i].action_off);
+            }
+        }
+        profile = profile == &bindings->default_profile ?
+            bindings->profiles : profile->next;
+    }
+}
+
+/* SIGUSR1: the report goes to syslog, a line per message */
+void stats_log()
+{
+    char *text = NULL, *line, *save;
+    size_t size;
+    FILE *out;
+
+    if (!(out = open_memstream(&text, &size)))
+        return;
+    stats_report(out);
+    fclose(out);
+
+    openlog("joy2script", LOG_PID, LOG_DAEMON);
+    for (line = strtok_r(text, "\n", &save); line;
+            line = strtok_r(NULL, "\n", &save))
+        syslog(LOG_INFO, "%s", line);
+    free(text);
+}
+
+/* -control: a UNIX socket that sends the report to whoever connects */
+int control_init()
+{
+    struct sockaddr_un addr;
+    static struct s_watch control_watch;
+
+    if (strlen(control_path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, control_path);
+    unlink(control_path);
+
+    control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (control_fd == -1 ||
+            bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+            listen(control_fd, 4) ||
+            watch_add(control_fd, &control_watch, WATCH_CONTROL, NULL))
+        return -1;
+    return 0;
+}
+
+void control_accept()
+{
+    FILE *out;
+    int fd;
+
+    while ((fd = accept4(control_fd, NULL, NULL, SOCK_CLOEXEC)) != -1)
+    {
+        /* The report is small enough for the socket buffer, but don't
+         * let a client that never reads hold us up */
+        struct timeval timeout = {0, 100000};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if ((out = fdopen(fd, "w")))
+        {
+            stats_report(out);
+            fclose(out);
+        }
+        else
+            close(fd);
+    }
+}
+
+long long elapsed_us(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000LL +
+        (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+void benchmark_report(const char *name, int count, long long us)
+{
+    printf("%-19s %d actions in %lld us (%lld us/action, %lld/s)\n", name,
+            count, us, us / count, us ? count * 1000000LL / us : 0);
+}
+
+/* Time count trivial actions through system(), through an @fd: sink
+ * read by us and through the worker pool, waiting for the pool to drain
+ * so the numbers cover the whole run of the commands. */
+int executor_benchmark(int count)
+{
+    int i, sv[2];
+    long long sys_us, pool_us;
+    struct timespec start;
+    struct s_worker *worker;
+    struct s_action *action;
+    char buffer[4096];
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++)
+        system("true");
+    sys_us = elapsed_us(&start);
+    benchmark_report("system():", count, sys_us);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0)
+    {
+        snprintf(buffer, sizeof(buffer), "@fd:%d true %%v", sv[0]);
+        action = compile_action(buffer, NULL);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < count; i++)
+        {
+            send_action(action, i, 1);
+            while (recv(sv[1], buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+                ;
+        }
+        benchmark_report("sink (@fd):", count, elapsed_us(&start));
+        if (action->sink->dropped)
+            printf("    %lu messages dropped\n", action->sink->dropped);
+        close(sv[0]);
+        close(sv[1]);
+    }
+
+    if (executor_init() || num_workers == 0)
+    {
+        puts("No workers available, nothing to compare");
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; )
+    {
+        if ((worker = worker_pick()))
+            i += worker_send(worker, NULL, "true\n", 5) == 0;
+        else
+            handle_events(-1);
+    }
+    while (running_jobs)
+        handle_events(-1);
+    pool_us = elapsed_us(&start);
+
+    snprintf(buffer, sizeof(buffer), "worker pool (%d):", num_workers);
+    benchmark_report(buffer, count, pool_us);
+    return 0;
+}
+
+/* Apply the real-time options to this process.  Anything the system
+ * won't allow is reported and otherwise ignored: joy2script still works,
+ * only with less predictable timing.  The priority is given with
+ * SCHED_RESET_ON_FORK, so commands run by actions don't inherit it. */
+int realtime_init()
+{
+    struct sched_param param = {0};
+    cpu_set_t cpus;
+    int failed = 0;
+
+    sched_getaffinity(0, sizeof(rt_original_cpus), &rt_original_cpus);
+    if (rt_cpu >= 0)
+    {
+        CPU_ZERO(&cpus);
+        CPU_SET(rt_cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus))
+        {
+            printf("joy2script: can't pin to CPU %d: %s\n", rt_cpu,
+                    strerror(errno));
+            failed = 1;
+        }
+    }
+
+    if (rt_lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE))
+    {
+        printf("joy2script: can't lock memory: %s\n", strerror(errno));
+        failed = 1;
+    }
+
+    if (rt_priority > 0)
+    {
+        param.sched_priority = rt_priority;
+        if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param))
+        {
+            printf("joy2script: can't use SCHED_FIFO priority %d: %s\n",
+                    rt_priority, strerror(errno));
+            failed = 1;
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+/* Ask for count wakeups a millisecond apart and record how late each
+ * one is */
+void realtime_measure(const char *name, int count)
+{
+    struct s_histogram h = {.name = name};
+    struct itimerspec its = {{0, 0}, {0, 0}};
+    unsigned long long deadline, now, expirations;
+    int i, fd;
+
+    if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) == -1)
+    {
+        perror("joy2script: timerfd_create");
+        return;
+    }
+    for (i = 0; i < count; i++)
+    {
+        deadline = monotonic_ns() + 1000000;
+        its.it_value.tv_sec = deadline / 1000000000;
+        its.it_value.tv_nsec = deadline % 1000000000;
+        timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL);
+        if (read(fd, &expirations, sizeof(expirations)) < 0)
+            break;
+        now = monotonic_ns();
+        hist_add(&h, now - deadline);
+    }
+    close(fd);
+
+    printf("%-10s %llu wakeups late by: p50 %llu us, p99 %llu us, "
+            "p99.9 %llu us, max %llu us\n", h.name, h.count,
+            hist_percentile(&h, 0.5) / 1000, hist_percentile(&h, 0.99) / 1000,
+            hist_percentile(&h, 0.999) / 1000, h.max / 1000);
+}
+
+/* Measure timer wakeups before and after the real-time options, to see
+ * what they are worth on this machine.  Without -rt-priority a middling
+ * one is tried.  The difference shows best with something else keeping
+ * the CPUs busy. */
+int realtime_test(int count)
+{
+    realtime_measure("normal:", count);
+    if (rt_priority == 0)
+        rt_priority = DEFAULT_RT_PRIORITY;
+    if (realtime_init())
+        puts("Some real-time options could not be applied");
+    realtime_measure("real-time:", count);
+    return 0;
+}
+
+int check_config(int argc, char **argv)
+{
+    int i, x;
+    char *path;
+    
+    for(i=1; i<argc; i++)
+    {
+	if(!strcmp("-config", argv[i]))
+	{
+		if(i+2>argc) 
+		{
+			puts("Not enough arguments to -config");
+			exit(1);
+		}
+		config_file=argv[i+1];
+		argc-=2;
+		for(x=i; x<argc; x++) argv[x]=argv[x+2];
+		i--;
+	}
+	else if(!strcmp("-no-cache", argv[i]))
+	{
+		use_cache=0;
+		argc--;
+		for(x=i; x<argc; x++) argv[x]=argv[x+1];
+		i--;
+	}
+    }
+
+    /* The daemon moves to /, and a reload must still find the file */
+    if (strcmp(config_file, DEFAULT_CONFIG_FILE) &&
+            (path = realpath(config_file, NULL)))
+        config_file = path;
+
+    if (!(bindings = parse_config()))
+        exit(1);
+    return argc;
+}
+
+/* The config for an axis, growing the mode's table to reach it */
+struct s_axis_config *profile_axis(struct s_profile *profile, int m,
+        int number)
+{
+    struct s_mode *mode = &profile->mode[m];
+
+    if (number >= mode->num_axes)
+    {
+        mode->axis = realloc(mode->axis,
+                (number + 1) * sizeof(struct s_axis_config));
+        memset(mode->axis + mode->num_axes, 0,
+                (number + 1 - mode->num_axes) * sizeof(struct s_axis_config));
+        mode->num_axes = number + 1;
+    }
+    if (m >= profile->num_modes)
+        profile->num_modes = m + 1;
+    return &mode->axis[number];
+}
+
+struct s_button_config *profile_button(struct s_profile *profile, int m,
+        int number)
+{
+    struct s_mode *mode = &profile->mode[m];
+
+    if (number >= mode->num_buttons)
+    {
+        mode->button = realloc(mode->button,
+                (number + 1) * sizeof(struct s_button_config));
+        memset(mode->button + mode->num_buttons, 0,
+                (number + 1 - mode->num_buttons) *
+                sizeof(struct s_button_config));
+        mode->num_buttons = number + 1;
+    }
+    if (m >= profile->num_modes)
+        profile->num_modes = m + 1;
+    return &mode->button[number];
+}
+
+double curve_apply(const struct s_curve *curve, double t)
+{
+    double x;
+    int i;
+
+    switch (curve->type)
+    {
+    case CURVE_LOG:
+        return log10(1 + 9 * t);
+    case CURVE_EXP:
+        return (pow(10, t) - 1) / 9;
+    case CURVE_POWER:
+        return pow(t, curve->power);
+    case CURVE_POINTS:
+        /* Straight lines between the points, flat beyond the ends */
+        x = t * 100;
+        if (x <= curve->x[0])
+            return curve->y[0] / 100.0;
+        for (i = 1; i < curve->num_points; i++)
+        {
+            if (x <= curve->x[i])
+                return (curve->y[i - 1] + (curve->y[i] - curve->y[i - 1]) *
+                        (x - curve->x[i - 1]) /
+                        (curve->x[i] - curve->x[i - 1])) / 100.0;
+        }
+        return curve->y[curve->num_points - 1] / 100.0;
+    default:
+        return t;
+    }
+}
+
+int curve_equal(const struct s_curve *a, const struct s_curve *b)
+{
+    return a->type == b->type &&
+        (a->type != CURVE_POWER || a->power == b->power) &&
+        (a->type != CURVE_POINTS || (a->num_points == b->num_points &&
+            !memcmp(a->x, b->x, a->num_points * sizeof(short)) &&
+            !memcmp(a->y, b->y, a->num_points * sizeof(short))));
+}
+
+/* Look up or build the table going from low to high along curve.  A
+ * symmetric axis gives the same result either side of the centre; if
+ * is_signed it is negated on the negative side. */
+const int *curve_table(const struct s_curve *curve, int asymmetric,
+        int is_signed, int low, int high)
+{
+    struct s_curve_table *entry;
+    double t;
+    int i, v, sign;
+
+    for (entry = curve_tables; entry; entry = entry->next)
+    {
+        if (curve_equal(&entry->curve, curve) &&
+                entry->asymmetric == asymmetric &&
+                entry->is_signed == is_signed &&
+                entry->low == low && entry->high == high)
+            return entry->table;
+    }
+
+    entry = calloc(1, sizeof(struct s_curve_table));
+    entry->curve = *curve;
+    entry->asymmetric = asymmetric;
+    entry->is_signed = is_signed;
+    entry->low = low;
+    entry->high = high;
+    entry->table = malloc(CURVE_SIZE * sizeof(int));
+
+    for (i = 0; i < CURVE_SIZE; i++)
+    {
+        sign = 1;
+        if (asymmetric)
+            t = (i - 1) / 65536.0;
+        else
+        {
+            v = i - 32768;
+            if (v < 0)
+            {
+                sign = -1;
+                v = -v;
+            }
+            t = v / 32768.0;
+        }
+        if (t < 0)
+            t = 0;
+        if (t > 1)
+            t = 1;
+
+        v = low + curve_apply(curve, t) * (high - low);
+        entry->table[i] = is_signed ? sign * v : v;
+    }
+
+    entry->next = curve_tables;
+    curve_tables = entry;
+    return entry->table;
+}
+
+/* Parse the value of a curve option: linear, log, exp, power P or
+ * points X:Y ... with X and Y in percent.  Returns 0 if it is invalid. */
+int parse_curve(const char *text, struct s_curve *curve)
+{
+    char name[16];
+    int x, y, n;
+
+    memset(curve, 0, sizeof(struct s_curve));
+    if (sscanf(text, " %15s%n", name, &n) != 1)
+        return 0;
+    text += n;
+
+    if (!strcmp(name, "linear"))
+        curve->type = CURVE_LINEAR;
+    else if (!strcmp(name, "log"))
+        curve->type = CURVE_LOG;
+    else if (!strcmp(name, "exp"))
+        curve->type = CURVE_EXP;
+    else if (!strcmp(name, "power"))
+    {
+        curve->type = CURVE_POWER;
+        if (sscanf(text, " %lf%n", &curve->power, &n) != 1 ||
+                curve->power <= 0)
+            return 0;
+        text += n;
+    }
+    else if (!strcmp(name, "points"))
+    {
+        curve->type = CURVE_POINTS;
+        while (sscanf(text, " %d : %d%n", &x, &y, &n) == 2)
+        {
+            if (curve->num_points == MAX_CURVE_POINTS || x < 0 || x > 100 ||
+                    (curve->num_points &&
+                     x <= curve->x[curve->num_points - 1]))
+                return 0;
+            curve->x[curve->num_points] = x;
+            curve->y[curve->num_points++] = y;
+            text += n;
+        }
+        if (!curve->num_points)
+            return 0;
+    }
+    else
+        return 0;
+
+    /* Nothing may follow */
+    while (isspace((unsigned char)*text))
+        text++;
+    return *text == '\0';
+}
+
+/* skip, count, catchup or catchup N.  Returns 0 if it is none of them. */
+int parse_overrun(const char *text, int *overrun)
+{
+    char name[16];
+    int n, max;
+
+    if (sscanf(text, " %15s%n", name, &n) != 1)
+        return 0;
+    text += n;
+
+    if (!strcmp(name, "skip"))
+        *overrun = OVERRUN_SKIP;
+    else if (!strcmp(name, "count"))
+        *overrun = OVERRUN_COUNT;
+    else if (!strcmp(name, "catchup"))
+    {
+        *overrun = DEFAULT_CATCHUP;
+        if (sscanf(text, " %d%n", &max, &n) == 1)
+        {
+            if (max < 1)
+                return 0;
+            *overrun = max;
+            text += n;
+        }
+    }
+    else
+        return 0;
+
+    while (isspace((unsigned char)*text))
+        text++;
+    return *text == '\0';
+}
+
+/* Work out the curve tables for every axis that can use them */
+void curves_build(struct s_bindings *b)
+{
+    struct s_profile *profile = &b->default_profile;
+    struct s_axis_config *config;
+    int m, i;
+
+    while (profile)
+    {
+        for (m = 0; m < profile->num_modes; m++)
+        {
+            for (i = 0; i < profile->mode[m].num_axes; i++)
+            {
+                config = &profile->mode[m].axis[i];
+                /* integrate sums %v even with no action to send it */
+                if (config->action_on || config->action_off ||
+                        config->integrate > 0)
+                    config->output_table = curve_table(&config->curve,
+                            config->asymmetric, 1,
+                            config->output_low, config->output_high);
+                if (config->repeat && (config->repeat_rate_low != 0 ||
+                            config->repeat_rate_high != 0))
+                    config->rate_table = curve_table(&config->curve,
+                            config->asymmetric, 0,
+                            config->repeat_rate_low, config->repeat_rate_high);
+            }
+        }
+        profile = profile == &b->default_profile ? b->profiles : profile->next;
+    }
+}
+
+/* Build a mode's sequence automaton, Aho-Corasick style: a trie of the
+ * sequences, with every missing edge pointing where the longest suffix
+ * of the presses so far that is also a prefix of a sequence leads. */
+void sequences_build(struct s_mode *mode)
+{
+    struct s_automaton *a = &mode->sequences;
+    struct s_combo *combo;
+    unsigned long long timeout;
+    int *fail, *queue, head = 0, tail = 0;
+    int max_states = 1, s, t, u, i, b;
+
+    a->width = 0;
+    for (combo = mode->combos; combo; combo = combo->next)
+    {
+        max_states += combo->length;
+        for (i = 0; i < combo->length; i++)
+            if (combo->buttons[i] >= a->width)
+                a->width = combo->buttons[i] + 1;
+    }
+    if (max_states == 1)
+        return;
+
+    a->next = malloc(max_states * a->width * sizeof(short));
+    memset(a->next, 0xff, max_states * a->width * sizeof(short));
+    a->match = calloc(max_states, sizeof(struct s_combo *));
+    a->timeout = calloc(max_states, sizeof(unsigned long long));
+    a->num_states = 1;
+
+    for (combo = mode->combos; combo; combo = combo->next)
+    {
+        if (!combo->length)
+            continue;
+        timeout = combo->timeout * 1000000ULL;
+        for (s = 0, i = 0; i < combo->length; i++)
+        {
+            t = a->next[s * a->width + combo->buttons[i]];
+            if (t == -1)
+            {
+                t = a->num_states++;
+                a->next[s * a->width + combo->buttons[i]] = t;
+            }
+            /* A prefix shared by sequences waits as long as any of them */
+            if (timeout > a->timeout[t])
+                a->timeout[t] = timeout;
+            s = t;
+        }
+        if (!a->match[s])
+            a->match[s] = combo;
+    }
+
+    fail = calloc(a->num_states, sizeof(int));
+    queue = malloc(a->num_states * sizeof(int));
+    for (b = 0; b < a->width; b++)
+    {
+        t = a->next[b];
+        if (t == -1)
+            a->next[b] = 0;
+        else
+            queue[tail++] = t;
+    }
+    while (head < tail)
+    {
+        u = queue[head++];
+        for (b = 0; b < a->width; b++)
+        {
+            t = a->next[u * a->width + b];
+            if (t == -1)
+            {
+                a->next[u * a->width + b] = a->next[fail[u] * a->width + b];
+                continue;
+            }
+            fail[t] = a->next[fail[u] * a->width + b];
+            if (!a->match[t])
+                a->match[t] = a->match[fail[t]];
+            queue[tail++] = t;
+        }
+    }
+    free(fail);
+    free(queue);
+}
+
+/* Hash the chords and compile the sequences of every mode */
+void combos_build(struct s_bindings *b)
+{
+    struct s_profile *profile = &b->default_profile;
+    struct s_combo *combo;
+    struct s_mode *mode;
+    int m, num_chords, bucket;
+
+    while (profile)
+    {
+        for (m = 0; m < profile->num_modes; m++)
+        {
+            mode = &profile->mode[m];
+            num_chords = 0;
+            for (combo = mode->combos; combo; combo = combo->next)
+                num_chords += !combo->length;
+
+            if (num_chords)
+            {
+                mode->chord_table_size = 4;
+                while (mode->chord_table_size < 2 * num_chords)
+                    mode->chord_table_size *= 2;
+                mode->chord_table = calloc(mode->chord_table_size,
+                        sizeof(struct s_combo *));
+                for (combo = mode->combos; combo; combo = combo->next)
+                {
+                    if (combo->length)
+                        continue;
+                    bucket = chord_hash(combo->mask) &
+                        (mode->chord_table_size - 1);
+                    combo->next_hash = mode->chord_table[bucket];
+                    mode->chord_table[bucket] = combo;
+                }
+            }
+            if (num_chords < mode->num_combos)
+                sequences_build(mode);
+        }
+        profile = profile == &b->default_profile ? b->profiles : profile->next;
+    }
+}
+
+/* Print how much memory the bindings take */
+void config_report(struct s_bindings *b)
+{
+    struct s_profile *profile = &b->default_profile;
+    struct s_curve_table *entry;
+    size_t bytes = 0;
+    int m, num_profiles = 0, num_tables = 0;
+
+    while (profile)
+    {
+        for (m = 0; m < profile->num_modes; m++)
+            bytes += profile->mode[m].num_axes * sizeof(struct s_axis_config) +
+                profile->mode[m].num_buttons * sizeof(struct s_button_config);
+        num_profiles++;
+        profile = profile == &b->default_profile ? b->profiles : profile->next;
+    }
+
+    for (entry = curve_tables; entry; entry = entry->next)
+        num_tables++;
+
+    printf("Config: %d profiles, %zu bytes of bindings, %zu strings in %zu "
+            "bytes (%zu bytes of duplicates shared)\n", num_profiles, bytes,
+            strings.count, strings.bytes, strings.saved);
+    printf("    %d curve tables in %zu bytes\n", num_tables,
+            num_tables * CURVE_SIZE * sizeof(int));
+}
+
+void action_free(struct s_action *action)
+{
+    int i;
+
+    if (!action)
+        return;
+    if (action->running || action->queued)
+        executor_forget(action);
+    free(action->template.segments);
+    if (action->argv)
+    {
+        for (i = 0; action->argv[i]; i++)
+            free(action->argv_templates[i].segments);
+        free(action->argv_templates);
+        free(action->argv);
+    }
+    free(action);
+}
+
+void bindings_free(struct s_bindings *b)
+{
+    struct s_profile *profile = &b->default_profile, *next;
+    struct s_combo *combo;
+    struct s_mode *mode;
+    int m, i;
+
+    while (profile)
+    {
+        for (m = 0; m < MAX_MODES; m++)
+        {
+            mode = &profile->mode[m];
+            for (i = 0; i < mode->num_axes; i++)
+            {
+                action_free(mode->axis[i].action_on);
+                action_free(mode->axis[i].action_off);
+            }
+            for (i = 0; i < mode->num_buttons; i++)
+            {
+                action_free(mode->button[i].action_on);
+                action_free(mode->button[i].action_off);
+            }
+            free(mode->axis);
+            free(mode->button);
+            while ((combo = mode->combos))
+            {
+                mode->combos = combo->next;
+                action_free(combo->config.action_on);
+                action_free(combo->config.action_off);
+                free(combo->buttons);
+                free(combo);
+            }
+            free(mode->chord_table);
+            free(mode->sequences.next);
+            free(mode->sequences.match);
+            free(mode->sequences.timeout);
+        }
+        next = profile == &b->default_profile ? b->profiles : profile->next;
+        if (profile != &b->default_profile)
+            free(profile);
+        profile = next;
+    }
+    free(b);
+}
+
+/* SIGHUP or the config file changed: load it again and move every
+ * device over to it.  This runs between batches of events, so the swap
+ * is all at once as far as they are concerned. */
+void config_reload()
+{
+    struct s_bindings *new, *old = bindings;
+    struct s_device *dev;
+
+    printf("Reloading %s\n", config_file);
+    if (!(new = parse_config()))
+    {
+        printf("Keeping the old config\n");
+        return;
+    }
+
+    for (dev = devices; dev; dev = dev->next)
+        if (dev->fd != -1)
+            device_rebind(dev, profile_for(new, dev->path, dev->name));
+    bindings = new;
+    bindings_free(old);
+}
+
+/* The settings an [axis], [button], [chord] or [sequence] section can
+ * have, and where each goes in its config.  An offset of -1 means it
+ * has no meaning there. */
+typedef enum {KEY_INT, KEY_HALF, KEY_RATE, KEY_PERCENT, KEY_ACTION,
+    KEY_CURVE, KEY_OVERRUN} key_type;
+typedef enum {SECTION_AXIS, SECTION_BUTTON, SECTION_COMBO,
+    NUM_SECTIONS} section_type;
+
+const char *section_names[NUM_SECTIONS] = {"an axis", "a button",
+    "a chord or sequence"};
+
+#define AXIS_KEY(field)     offsetof(struct s_axis_config, field)
+#define BUTTON_KEY(field)   offsetof(struct s_button_config, field)
+#define COMBO_KEY(field)    offsetof(struct s_combo, field)
+
+const struct s_config_key {
+    const char *name;
+    key_type type;
+    int offset[NUM_SECTIONS];
+} config_keys[] = {
+    {"action_on", KEY_ACTION, {AXIS_KEY(action_on), BUTTON_KEY(action_on),
+        COMBO_KEY(config.action_on)}},
+    {"action_off", KEY_ACTION, {AXIS_KEY(action_off), BUTTON_KEY(action_off),
+        COMBO_KEY(config.action_off)}},
+    /* On an axis this is repeat_rate_low and repeat_rate_high at once */
+    {"repeat_rate", KEY_RATE, {AXIS_KEY(repeat_rate_low),
+        BUTTON_KEY(repeat_rate), -1}},
+    {"repeat_rate_low", KEY_INT, {AXIS_KEY(repeat_rate_low), -1, -1}},
+    {"repeat_rate_high", KEY_INT, {AXIS_KEY(repeat_rate_high), -1, -1}},
+    {"repeat", KEY_INT, {AXIS_KEY(repeat), -1, -1}},
+    {"asymmetric", KEY_INT, {AXIS_KEY(asymmetric), -1, -1}},
+    {"deadzone", KEY_INT, {AXIS_KEY(deadzone), -1, -1}},
+    {"deadzone_size", KEY_HALF, {AXIS_KEY(deadzone_size), -1, -1}},
+    {"output_low", KEY_INT, {AXIS_KEY(output_low), -1, -1}},
+    {"output_high", KEY_INT, {AXIS_KEY(output_high), -1, -1}},
+    {"curve", KEY_CURVE, {AXIS_KEY(curve), -1, -1}},
+    {"max_running", KEY_INT, {AXIS_KEY(max_running),
+        BUTTON_KEY(max_running), COMBO_KEY(config.max_running)}},
+    {"timeout", KEY_INT, {-1, -1, COMBO_KEY(timeout)}},
+    {"smoothing", KEY_PERCENT, {AXIS_KEY(smoothing), -1, -1}},
+    {"min_delta", KEY_INT, {AXIS_KEY(min_delta), -1, -1}},
+    {"max_rate", KEY_INT, {AXIS_KEY(max_rate), -1, -1}},
+    {"overrun", KEY_OVERRUN, {AXIS_KEY(overrun), BUTTON_KEY(overrun), -1}},
+    {"integrate", KEY_INT, {AXIS_KEY(integrate), -1, -1}},
+    {NULL}
+};
+
+/* Where the compiler has got to in the config text, and the section it
+ * is in.  config is the axis or button config settings go to, NULL
+ * before the first [axis] or [button] of a mode. */
+struct s_parser {
+    const char *p, *line_start;
+    int line;
+    int errors;
+    struct s_bindings *b;
+    struct s_profile *profile, **last_profile;
+    int mode;
+    section_type section;
+    void *config;
+};
+
+/* Say what is wrong at position at of the current line.  Errors make
+ * the whole config fail, but the compiler carries on to report them
+ * all. */
+void parse_message(struct s_parser *ps, const char *at, int is_error,
+        const char *format, ...)
+{
+    va_list args;
+
+    printf("%s:%d:%d: %s", config_file, ps->line,
+            (int)(at - ps->line_start) + 1, is_error ? "error: " : "");
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    putchar('\n');
+    if (is_error)
+        ps->errors++;
+}
+
+void skip_blanks(struct s_parser *ps)
+{
+    while (*ps->p == ' ' || *ps->p == '\t' || *ps->p == '\r')
+        ps->p++;
+}
+
+void skip_line(struct s_parser *ps)
+{
+    ps->p += strcspn(ps->p, "\n");
+}
+
+/* A whole number, with nothing but blanks between it and end */
+int parse_int(struct s_parser *ps, const char *text, const char *end, int *x)
+{
+    char *after;
+    long n;
+
+    errno = 0;
+    n = strtol(text, &after, 10);
+    while (after < end && isspace((unsigned char)*after))
+        after++;
+    if (after == text || after != end || errno || n < INT_MIN || n > INT_MAX)
+    {
+        parse_message(ps, text, 1, "expected a number, not \"%.*s\"",
+                (int)(end - text), text);
+        return -1;
+    }
+    *x = n;
+    return 0;
+}
+
+/* The buttons of [chord A+B+...] or [sequence A B ...] (or A,B,...) */
+void parse_combo(struct s_parser *ps, int is_chord, const char *arg,
+        const char *end)
+{
+    unsigned char buttons[MAX_SEQUENCE];
+    struct s_mode *mode = &ps->profile->mode[ps->mode];
+    struct s_combo *combo;
+    const char *p = arg, *start;
+    int length = 0, n;
+
+    ps->config = NULL;
+    while (p < end)
+    {
+        start = p;
+        p += strcspn(p, is_chord ? "+]" : " \t,]");
+        if (p > end)
+            p = end;
+        if (parse_int(ps, start, p, &n))
+            return;
+        if (n < 0 || n >= MAX_CONTROLS)
+        {
+            parse_message(ps, start, 1, "button %d is out of range", n);
+            return;
+        }
+        if (length == MAX_SEQUENCE)
+        {
+            parse_message(ps, start, 1, "more than %d buttons", MAX_SEQUENCE);
+            return;
+        }
+        buttons[length++] = n;
+        while (p < end && (*p == '+' || *p == ',' || isspace((unsigned char)*p)))
+            p++;
+    }
+    if (length < 2)
+    {
+        parse_message(ps, arg, 1, "a %s needs at least two buttons",
+                is_chord ? "chord" : "sequence");
+        return;
+    }
+
+    combo = calloc(1, sizeof(struct s_combo));
+    combo->timeout = DEFAULT_SEQUENCE_TIMEOUT;
+    if (is_chord)
+    {
+        while (length--)
+            combo->mask[buttons[length] / 64] |=
+                1ULL << (buttons[length] % 64);
+    }
+    else
+    {
+        combo->buttons = malloc(length);
+        memcpy(combo->buttons, buttons, length);
+        combo->length = length;
+    }
+
+    /* Kept in the order they were written */
+    if (!mode->last_combo)
+        mode->last_combo = &mode->combos;
+    *mode->last_combo = combo;
+    mode->last_combo = &combo->next;
+    mode->num_combos++;
+    if (ps->mode >= ps->profile->num_modes)
+        ps->profile->num_modes = ps->mode + 1;
+    ps->config = combo;
+    ps->section = SECTION_COMBO;
+}
+
+/* [device MATCH], [mode N], [axis N], [button N], [chord ...] or
+ * [sequence ...].  Anything after the closing bracket is read as if it
+ * were on a line of its own. */
+void parse_section(struct s_parser *ps)
+{
+    const char *start = ps->p++, *name, *arg, *end;
+    int name_len, n;
+
+    skip_blanks(ps);
+    name = ps->p;
+    while (isalpha((unsigned char)*ps->p))
+        ps->p++;
+    name_len = ps->p - name;
+    skip_blanks(ps);
+    arg = ps->p;
+    end = arg + strcspn(arg, "]\n");
+    ps->p = end;
+    if (*end != ']')
+    {
+        parse_message(ps, start, 1, "section has no closing ']'");
+        return;
+    }
+    ps->p++;
+    while (end > arg && isspace((unsigned char)end[-1]))
+        end--;
+
+    if (name_len == 6 && !strncmp(name, "device", 6))
+    {
+        if (end == arg)
+        {
+            parse_message(ps, arg, 1, "[device] needs a name or path");
+            return;
+        }
+        /* Sections are tried in the order they appear */
+        ps->profile = calloc(1, sizeof(struct s_profile));
+        ps->profile->match = intern(arg, end - arg);
+        *ps->last_profile = ps->profile;
+        ps->last_profile = &ps->profile->next;
+        ps->mode = 0;
+        ps->config = NULL;
+        return;
+    }
+
+    if ((name_len == 5 && !strncmp(name, "chord", 5)) ||
+            (name_len == 8 && !strncmp(name, "sequence", 8)))
+    {
+        parse_combo(ps, name[0] == 'c', arg, end);
+        return;
     }
-    *p_buffer = '\0';
 
-#if DEBUG
-    printf("Axis action: %s\n", buffer);
-#endif
-    system(buffer);
+    if (!((name_len == 4 && !strncmp(name, "mode", 4)) ||
+                (name_len == 4 && !strncmp(name, "axis", 4)) ||
+                (name_len == 6 && !strncmp(name, "button", 6))))
+    {
+        parse_message(ps, name, 1, "unknown section \"%.*s\"", name_len,
+                name);
+        return;
+    }
+    if (parse_int(ps, arg, end, &n))
+        return;
+
+    if (name[0] == 'm')
+    {
+        if (n < 0 || n >= MAX_MODES)
+        {
+            parse_message(ps, arg, 1, "mode %d is out of range, there can "
+                    "only be %d", n, MAX_MODES);
+            return;
+        }
+        ps->mode = n;
+        ps->config = NULL;
+        if (n >= ps->profile->num_modes)
+            ps->profile->num_modes = n + 1;
+    }
+    else if (n < 0 || n >= MAX_CONTROLS)
+    {
+        parse_message(ps, arg, 1, "%.*s %d is out of range", name_len, name,
+                n);
+        ps->config = NULL;
+    }
+    else if (name[0] == 'a')
+    {
+        struct s_axis_config *axis = profile_axis(ps->profile, ps->mode, n);
+        axis->output_low = 0;
+        axis->output_high = 32768;
+        axis->deadzone = DEFAULT_DEADZONE;
+        axis->deadzone_size = DEFAULT_DEADZONE_SIZE;
+        ps->config = axis;
+        ps->section = SECTION_AXIS;
+    }
+    else
+    {
+        ps->config = profile_button(ps->profile, ps->mode, n);
+        ps->section = SECTION_BUTTON;
+    }
 }
 
-int check_config(int argc, char **argv)
+/* key = value, the value running to the end of the line */
+void parse_setting(struct s_parser *ps)
 {
-    int i, x;
-    
-    for(i=1; i<argc; i++)
+    const struct s_config_key *key;
+    const char *name = ps->p, *value, *end;
+    char text[MAX_ACTION_STRING];
+    struct s_action *action;
+    const char *error;
+    int name_len, offset, x;
+    char *field;
+
+    while (isalnum((unsigned char)*ps->p) || *ps->p == '_')
+        ps->p++;
+    name_len = ps->p - name;
+    skip_blanks(ps);
+    if (*ps->p != '=')
     {
-	if(!strcmp("-config", argv[i]))
-	{
-		if(i+2>argc) 
-		{
-			puts("Not enough arguments to -config");
-			exit(1);
-		}
-		config_file=argv[++i];
-		argc-=2;
-		for(x=i; x<argc; x++) argv[x]=argv[x+2];
-	}
+        parse_message(ps, ps->p, 1, "expected '=' after \"%.*s\"", name_len,
+                name);
+        skip_line(ps);
+        return;
     }
-    parse_config();
-    return argc;
+    ps->p++;
+    skip_blanks(ps);
+    value = ps->p;
+    skip_line(ps);
+    end = ps->p;
+    while (end > value && isspace((unsigned char)end[-1]))
+        end--;
+
+    for (key = config_keys; key->name; key++)
+        if (strlen(key->name) == (size_t)name_len &&
+                !strncmp(key->name, name, name_len))
+            break;
+    if (!key->name)
+    {
+        parse_message(ps, name, 1, "unknown setting \"%.*s\"", name_len,
+                name);
+        return;
+    }
+    if (!ps->config)
+    {
+        parse_message(ps, name, 1, "%s needs an [axis], [button], [chord] or "
+                "[sequence] first", key->name);
+        return;
+    }
+    offset = key->offset[ps->section];
+    if (offset == -1)
+    {
+        parse_message(ps, name, 0, "warning: %s has no meaning for %s",
+                key->name, section_names[ps->section]);
+        return;
+    }
+    field = (char *)ps->config + offset;
+
+    if (end - value >= MAX_ACTION_STRING)
+    {
+        parse_message(ps, value, 1, "value is longer than %d characters",
+                MAX_ACTION_STRING - 1);
+        return;
+    }
+    memcpy(text, value, end - value);
+    text[end - value] = '\0';
+
+    switch (key->type)
+    {
+    case KEY_INT:
+    case KEY_HALF:
+    case KEY_RATE:
+    case KEY_PERCENT:
+        if (parse_int(ps, value, end, &x))
+            return;
+        if (key->type == KEY_PERCENT && (x < 0 || x > 100))
+        {
+            parse_message(ps, value, 1, "%s must be from 0 to 100, not %d",
+                    key->name, x);
+            return;
+        }
+        if (key->type == KEY_HALF)
+            x /= 2;
+        *(int *)field = x;
+        if (key->type == KEY_RATE && ps->section == SECTION_AXIS)
+            ((struct s_axis_config *)ps->config)->repeat_rate_high = x;
+        break;
+    case KEY_ACTION:
+        if (!(action = compile_action(text, &error)))
+        {
+            parse_message(ps, value, 1, "%s \"%s\"", error, text);
+            return;
+        }
+        action_free(*(struct s_action **)field);
+        *(struct s_action **)field = action;
+        break;
+    case KEY_CURVE:
+        if (!parse_curve(text, (struct s_curve *)field))
+            parse_message(ps, value, 1, "bad curve \"%s\"", text);
+        break;
+    case KEY_OVERRUN:
+        if (!parse_overrun(text, (int *)field))
+            parse_message(ps, value, 1, "bad overrun \"%s\", expected skip, "
+                    "count or catchup N", text);
+        break;
+    }
+}
+
+/* Compile the text of a config in one pass.  Returns NULL if there was
+ * an error, having reported every one with its line and column. */
+struct s_bindings *config_compile(const char *text)
+{
+    struct s_parser ps;
+
+    memset(&ps, 0, sizeof(ps));
+    ps.p = ps.line_start = text;
+    ps.line = 1;
+    ps.b = calloc(1, sizeof(struct s_bindings));
+    ps.profile = &ps.b->default_profile;
+    ps.last_profile = &ps.b->profiles;
+
+    while (*ps.p)
+    {
+        skip_blanks(&ps);
+        if (*ps.p == '\n')
+        {
+            ps.line_start = ++ps.p;
+            ps.line++;
+        }
+        else if (*ps.p == '#')
+            skip_line(&ps);
+        else if (*ps.p == '[')
+            parse_section(&ps);
+        else if (isalpha((unsigned char)*ps.p) || *ps.p == '_')
+            parse_setting(&ps);
+        else if (*ps.p)
+        {
+            parse_message(&ps, ps.p, 1, "unexpected '%c'", *ps.p);
+            skip_line(&ps);
+        }
+    }
+
+    if (ps.errors)
+    {
+        printf("%s: %d error%s\n", config_file, ps.errors,
+                ps.errors == 1 ? "" : "s");
+        bindings_free(ps.b);
+        return NULL;
+    }
+    return ps.b;
+}
+
+/* The compiled config is saved to config_file.cache so the next start
+ * can skip compiling it.  The cache only holds for the exact config text
+ * (by mtime, size and hash) and the exact build that wrote it.  Configs
+ * are dumped as they are in memory, with each action replaced by its
+ * command, which is compiled again on load. */
+#define CACHE_MAGIC     "j2scfg1 " JOY2SCRIPT_VERSION " " __DATE__ " " __TIME__
+#define CACHE_NONE      0xffffffffu
+
+struct s_cache_header {
+    char magic[64];
+    int64_t mtime_ns;
+    uint64_t size;
+    uint32_t hash;
+    uint32_t num_profiles;
+};
+
+void cache_put_string(FILE *file, const char *text)
+{
+    uint32_t len = text ? strlen(text) : CACHE_NONE;
+
+    fwrite(&len, sizeof(len), 1, file);
+    if (text)
+        fwrite(text, 1, len, file);
+}
+
+void cache_put_action(FILE *file, const struct s_action *action)
+{
+    cache_put_string(file, action ? action->command : NULL);
 }
 
-void parse_config()
+void cache_save(const char *path, struct s_bindings *b,
+        struct s_cache_header *header)
 {
+    struct s_profile *profile = &b->default_profile;
+    struct s_axis_config axis;
+    struct s_button_config button;
+    struct s_combo combo, *c;
+    char temp[PATH_MAX];
     FILE *file;
-    char line[1024];
-    int current_mode=-1;
-    int current_item=-1;/*axis/button #*/
-    int parsing_axis=-1;
-    int x;
+    int m, i;
+
+    /* Written aside and renamed, so a reader never sees half of it */
+    snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+    if (!(file = fopen(temp, "we")))
+        return;
+
+    for (header->num_profiles = 0; profile; header->num_profiles++)
+        profile = profile == &b->default_profile ? b->profiles :
+            profile->next;
+    fwrite(header, sizeof(*header), 1, file);
+
+    for (profile = &b->default_profile; profile; profile =
+            profile == &b->default_profile ? b->profiles : profile->next)
+    {
+        cache_put_string(file, profile->match);
+        fwrite(&profile->num_modes, sizeof(int), 1, file);
+        for (m = 0; m < profile->num_modes; m++)
+        {
+            fwrite(&profile->mode[m].num_axes, sizeof(int), 1, file);
+            fwrite(&profile->mode[m].num_buttons, sizeof(int), 1, file);
+            for (i = 0; i < profile->mode[m].num_axes; i++)
+            {
+                axis = profile->mode[m].axis[i];
+                axis.action_on = axis.action_off = NULL;
+                axis.output_table = axis.rate_table = NULL;
+                fwrite(&axis, sizeof(axis), 1, file);
+                cache_put_action(file, profile->mode[m].axis[i].action_on);
+                cache_put_action(file, profile->mode[m].axis[i].action_off);
+            }
+            for (i = 0; i < profile->mode[m].num_buttons; i++)
+            {
+                button = profile->mode[m].button[i];
+                button.action_on = button.action_off = NULL;
+                fwrite(&button, sizeof(button), 1, file);
+                cache_put_action(file, profile->mode[m].button[i].action_on);
+                cache_put_action(file, profile->mode[m].button[i].action_off);
+            }
+            fwrite(&profile->mode[m].num_combos, sizeof(int), 1, file);
+            for (c = profile->mode[m].combos; c; c = c->next)
+            {
+                combo = *c;
+                combo.config.action_on = combo.config.action_off = NULL;
+                combo.buttons = NULL;
+                combo.next = combo.next_hash = NULL;
+                fwrite(&combo, sizeof(combo), 1, file);
+                fwrite(c->buttons, 1, c->length, file);
+                cache_put_action(file, c->config.action_on);
+                cache_put_action(file, c->config.action_off);
+            }
+        }
+    }
+
+    if (fclose(file) || rename(temp, path))
+        unlink(temp);
+}
+
+/* Reading a cache: a cursor over the whole file, failing rather than
+ * reading past its end */
+struct s_cache_reader {
+    const char *p, *end;
+    int failed;
+};
+
+void cache_get(struct s_cache_reader *r, void *data, size_t size)
+{
+    if (r->failed || (size_t)(r->end - r->p) < size)
+    {
+        r->failed = 1;
+        memset(data, 0, size);
+        return;
+    }
+    memcpy(data, r->p, size);
+    r->p += size;
+}
+
+const char *cache_get_string(struct s_cache_reader *r)
+{
+    const char *text;
+    uint32_t len;
+
+    cache_get(r, &len, sizeof(len));
+    if (r->failed || len == CACHE_NONE)
+        return NULL;
+    if ((size_t)(r->end - r->p) < len)
+    {
+        r->failed = 1;
+        return NULL;
+    }
+    text = intern(r->p, len);
+    r->p += len;
+    return text;
+}
+
+struct s_action *cache_get_action(struct s_cache_reader *r)
+{
+    const char *command = cache_get_string(r);
+    struct s_action *action = NULL;
+
+    if (command && !(action = compile_action(command, NULL)))
+        r->failed = 1;
+    return action;
+}
+
+/* The bindings saved in the cache at path, if it was written for
+ * exactly this config by exactly this build, or NULL */
+struct s_bindings *cache_load(const char *path,
+        const struct s_cache_header *want)
+{
+    struct s_cache_header header;
+    struct s_cache_reader r;
+    struct s_bindings *b;
+    struct s_profile *profile = NULL, **last;
+    struct s_mode *mode;
+    struct s_combo *combo;
+    struct stat st;
+    char *data;
+    unsigned int p;
+    int fd, m, i, num;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+        return NULL;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(header) ||
+            !(data = malloc(st.st_size)))
+    {
+        close(fd);
+        return NULL;
+    }
+    if (read(fd, data, st.st_size) != st.st_size)
+    {
+        close(fd);
+        free(data);
+        return NULL;
+    }
+    close(fd);
+
+    r.p = data;
+    r.end = data + st.st_size;
+    r.failed = 0;
+    cache_get(&r, &header, sizeof(header));
+    if (memcmp(header.magic, want->magic, sizeof(header.magic)) ||
+            header.mtime_ns != want->mtime_ns || header.size != want->size ||
+            header.hash != want->hash)
+    {
+        free(data);
+        return NULL;
+    }
+
+    b = calloc(1, sizeof(struct s_bindings));
+    last = &b->profiles;
+    for (p = 0; p < header.num_profiles && !r.failed; p++)
+    {
+        if (p == 0)
+            profile = &b->default_profile;
+        else
+        {
+            profile = calloc(1, sizeof(struct s_profile));
+            *last = profile;
+            last = &profile->next;
+        }
+        profile->match = cache_get_string(&r);
+        cache_get(&r, &profile->num_modes, sizeof(int));
+        if (profile->num_modes < 0 || profile->num_modes > MAX_MODES)
+            r.failed = 1;
+
+        for (m = 0; m < profile->num_modes && !r.failed; m++)
+        {
+            mode = &profile->mode[m];
+            cache_get(&r, &num, sizeof(int));
+            if (num > 0 && num <= MAX_CONTROLS)
+                profile_axis(profile, m, num - 1);
+            cache_get(&r, &num, sizeof(int));
+            if (num > 0 && num <= MAX_CONTROLS)
+                profile_button(profile, m, num - 1);
+
+            for (i = 0; i < mode->num_axes && !r.failed; i++)
+            {
+                cache_get(&r, &mode->axis[i], sizeof(struct s_axis_config));
+                mode->axis[i].action_on = cache_get_action(&r);
+                mode->axis[i].action_off = cache_get_action(&r);
+            }
+            for (i = 0; i < mode->num_buttons && !r.failed; i++)
+            {
+                cache_get(&r, &mode->button[i],
+                        sizeof(struct s_button_config));
+                mode->button[i].action_on = cache_get_action(&r);
+                mode->button[i].action_off = cache_get_action(&r);
+            }
+
+            cache_get(&r, &num, sizeof(int));
+            mode->last_combo = &mode->combos;
+            for (i = 0; i < num && !r.failed; i++)
+            {
+                combo = calloc(1, sizeof(struct s_combo));
+                *mode->last_combo = combo;
+                mode->last_combo = &combo->next;
+                mode->num_combos++;
+                cache_get(&r, combo, sizeof(struct s_combo));
+                combo->config.action_on = combo->config.action_off = NULL;
+                combo->next = combo->next_hash = NULL;
+                combo->buttons = NULL;
+                if (combo->length < 0 || combo->length > MAX_SEQUENCE)
+                {
+                    combo->length = 0;
+                    r.failed = 1;
+                    break;
+                }
+                if (combo->length)
+                {
+                    combo->buttons = malloc(combo->length);
+                    cache_get(&r, combo->buttons, combo->length);
+                }
+                combo->config.action_on = cache_get_action(&r);
+                combo->config.action_off = cache_get_action(&r);
+            }
+        }
+    }
+    free(data);
+
+    if (r.failed || r.p != r.end)
+    {
+        bindings_free(b);
+        return NULL;
+    }
+    return b;
+}
+
+/* Read the config file into a new set of bindings, from the cache if it
+ * is up to date.  Returns NULL, having said why, if it can't be read or
+ * has an error in it. */
+struct s_bindings *parse_config()
+{
+    struct s_cache_header header;
+    struct s_bindings *b;
+    struct stat st;
+    char *text, cache_path[PATH_MAX];
+    int fd, x;
+
 	if(!strcmp(config_file, DEFAULT_CONFIG_FILE))
 	{
 		x=strlen(getenv("HOME")) + strlen(config_file) + 2;
 		config_file=(char*)malloc(x);
 		sprintf(config_file, "%s/%s", getenv("HOME"), DEFAULT_CONFIG_FILE);
 	}
-	if((file=fopen(config_file, "r"))==NULL)
+	if((fd=open(config_file, O_RDONLY | O_CLOEXEC))==-1 || fstat(fd, &st) ||
+            !(text = malloc(st.st_size + 1)))
 	{
 		printf("Cannot open config file \"%s\"\n", config_file);
-		exit(1);
+        if (fd != -1)
+            close(fd);
+		return NULL;
 	}
-	while(!feof(file))
-	{
-        fscanf(file, " %[^ \t=] ", line);
-		current_mode=0;
-        
-		if(!strcmp(line, "[mode"))
+    if (read(fd, text, st.st_size) != st.st_size)
+    {
+		printf("Cannot read config file \"%s\"\n", config_file);
+        close(fd);
+        free(text);
+        return NULL;
+    }
+    close(fd);
+    text[st.st_size] = '\0';
+
+    memset(&header, 0, sizeof(header));
+    strncpy(header.magic, CACHE_MAGIC, sizeof(header.magic) - 1);
+    header.mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    header.size = st.st_size;
+    header.hash = hash_string(text, st.st_size);
+    snprintf(cache_path, sizeof(cache_path), "%s.cache", config_file);
+
+    if (use_cache && (b = cache_load(cache_path, &header)))
+        printf("Loaded %s from %s\n", config_file, cache_path);
+    else if ((b = config_compile(text)) && use_cache)
+        cache_save(cache_path, b, &header);
+    free(text);
+    if (!b)
+        return NULL;
+
+    curves_build(b);
+    combos_build(b);
+    config_report(b);
+    return b;
+}
+
+void process_args(int argc, char **argv)
+{
+    int i;
+
+    if(!argv[1]) return;
+    for(i=(argc == 1 || argv[1][0] == '-') ? 1 : 2; i<argc; i++)
+    {
+		if(!strcmp(argv[i], "-dev"))
 		{
-			fscanf(file, " %d ] ", &current_mode);
-			if (current_mode > MAX_MODES-1) {
-				printf("error: Too many modes defined! Only %d allowed.", MAX_MODES);
+			if(i+2>argc) 
+			{
+				puts("Not enough arguments to -dev");
 				exit(1);
 			}
-#if DEBUG
-            printf("Found mode: %d\n", current_mode);
-#endif
-		}
-		else if(!strcmp(line, "[axis")) 
-		{
-			if (current_mode == -1)
+			if (num_device_paths == MAX_DEVICES)
 			{
-				printf("Error parsing axis: no mode given");
+				printf("Too many devices, only %d allowed\n", MAX_DEVICES);
 				exit(1);
 			}
-			fscanf(file, " %d ] ", &current_item);
-            mode[current_mode].axis[current_item].output_low = 0;
-            mode[current_mode].axis[current_item].output_high = 32768;
-            mode[current_mode].axis[current_item].deadzone = DEFAULT_DEADZONE;
-            mode[current_mode].axis[current_item].deadzone_size = 
-                DEFAULT_DEADZONE_SIZE;
-			parsing_axis=1;
-#if DEBUG
-            printf("Found axis: %d\n", current_item);
-#endif
-		} 
-		else if(!strcmp(line, "[button")) 
-		{
-			if (current_mode == -1)
+			device_paths[num_device_paths++]=strdup(argv[++i]);
+			continue;
+		} else if (!strcmp(argv[i], "-evdev")) {
+			backend = BACKEND_EVDEV;
+			continue;
+		} else if (!strcmp(argv[i], "--no-daemon")) {
+            daemonize = 0;
+            continue;
+        } else if (!strcmp(argv[i], "-workers")) {
+			if(i+2>argc) 
 			{
-				printf("Error parsing button: no mode given");
+				puts("Not enough arguments to -workers");
 				exit(1);
 			}
-			fscanf(file, " %d ] ", &current_item);
-			parsing_axis=0;
-#if DEBUG
-            printf("Found button: %d\n", current_item);
-#endif
-		} 
-		else if (!strcmp(line, "action_on"))
-		{
-			if (current_item == -1)
+			num_workers=atoi(argv[++i]);
+			continue;
+        } else if (!strcmp(argv[i], "-max-children")) {
+			if(i+2>argc)
 			{
-				printf("Error parsing action: no axis or button given");
+				puts("Not enough arguments to -max-children");
 				exit(1);
 			}
-			fscanf(file, " = ");
-            fgets(line, 1024, file);
-			if (parsing_axis)
-				mode[current_mode].axis[current_item].action_on=strdup(line);
-			else
-				mode[current_mode].button[current_item].action_on=strdup(line);
-#if DEBUG
-            printf("Found action_on: %s\n", line);
-#endif
-		}
-		else if (!strcmp(line, "action_off"))
-		{
-			if (current_item == -1)
+			max_children=atoi(argv[++i]);
+			if (max_children < 1)
+				max_children = 1;
+			continue;
+        } else if (!strcmp(argv[i], "-max-queued")) {
+			if(i+2>argc)
+			{
+				puts("Not enough arguments to -max-queued");
+				exit(1);
+			}
+			max_queued=atoi(argv[++i]);
+			if (max_queued < 0)
+				max_queued = 0;
+			continue;
+        } else if (!strcmp(argv[i], "-stream")) {
+			if(i+2>argc)
 			{
-				printf("Error parsing action_off: no axis or button given");
+				puts("Not enough arguments to -stream");
 				exit(1);
 			}
-			fscanf(file, " = ");
-            fgets(line, 1024, file);
-			if (parsing_axis)
-				mode[current_mode].axis[current_item].action_off=strdup(line);
+			i++;
+			if (!strcmp(argv[i], "json"))
+				stream.format = STREAM_JSON;
+			else if (!strcmp(argv[i], "binary"))
+				stream.format = STREAM_BINARY;
 			else
-				mode[current_mode].button[current_item].action_off=strdup(line);
-#if DEBUG
-            printf("Found action_off: %s\n", line);
-#endif
-		}
-		else if (!strcmp(line, "repeat_rate"))
-		{
-			if (current_item == -1)
 			{
-				printf("Error parsing repeat_rate: no axis or button given");
+				printf("Unknown stream format %s\n", argv[i]);
 				exit(1);
 			}
-			fscanf(file, " = %d ", &x);
-			if (parsing_axis) {
-				mode[current_mode].axis[current_item].repeat_rate_low=x;
-				mode[current_mode].axis[current_item].repeat_rate_high=x;
-            } else {
-				mode[current_mode].button[current_item].repeat_rate=x;
-            }
-		}
-		else if (!strcmp(line, "repeat_rate_high"))
-		{
-			if (current_item == -1)
+			continue;
+        } else if (!strcmp(argv[i], "-stream-socket")) {
+			if(i+2>argc)
 			{
-				printf("Error parsing repeat_rate_high: no axisgiven");
+				puts("Not enough arguments to -stream-socket");
 				exit(1);
 			}
-			if (parsing_axis==0)
-				printf("repeat_rate_high has no meaning for a button");
-			fscanf(file, " = %d ", &x);
-			if (parsing_axis)
-				mode[current_mode].axis[current_item].repeat_rate_high=x;
-		}
-		else if (!strcmp(line, "repeat_rate_low"))
-		{
-			if (current_item == -1)
+			stream.path = strdup(argv[++i]);
+			continue;
+        } else if (!strcmp(argv[i], "-control")) {
+			if(i+2>argc)
 			{
-				printf("Error parsing repeat_rate_low: no axisgiven");
+				puts("Not enough arguments to -control");
 				exit(1);
 			}
-			if (parsing_axis==0)
-				printf("repeat_rate_low has no meaning for a button");
-			fscanf(file, " = %d ", &x);
-			if (parsing_axis)
-				mode[current_mode].axis[current_item].repeat_rate_low=x;
-		}
-		else if (!strcmp(line, "asymmetric"))
-		{
-			if (current_item == -1)
+			control_path = strdup(argv[++i]);
+			continue;
+        } else if (!strcmp(argv[i], "-record")) {
+			if(i+2>argc)
 			{
-				printf("Error parsing asymmetric: no axis or button given");
+				puts("Not enough arguments to -record");
 				exit(1);
 			}
-			if (parsing_axis==0)
-				printf("asymmetric has no meaning for a button");
-			fscanf(file, " = %d ", &x);
-			if (parsing_axis)
-				mode[current_mode].axis[current_item].asymmetric=x;
-		}
-		else if (!strcmp(line, "deadzone"))
-		{
-			if (current_item == -1)
+			record_path = strdup(argv[++i]);
+			continue;
+        } else if (!strcmp(argv[i], "-replay")) {
+			if(i+2>argc)
 			{
-				printf("Error parsing deadzone: no axis or button given");
+				puts("Not enough arguments to -replay");
 				exit(1);
 			}
-			if (parsing_axis==0)
-				printf("deadzone has no meaning for a button");
-			fscanf(file, " = %d ", &x);
-			if (parsing_axis)
-				mode[current_mode].axis[current_item].deadzone=x;
-#if DEBUG
-            printf("Found deadzone: %d\n", x);
-#endif
-		}
-		else if (!strcmp(line, "deadzone_size"))
-		{
-			if (current_item == -1)
+			replay_path = strdup(argv[++i]);
+			continue;
+        } else if (!strcmp(argv[i], "-ring-size")) {
+			if(i+2>argc)
 			{
-				printf("Error parsing deadzone_size: no axis or button given");
+				puts("Not enough arguments to -ring-size");
 				exit(1);
 			}
-			if (parsing_axis==0)
-				printf("deadzone_size has no meaning for a button");
-			fscanf(file, " = %d ", &x);
-			if (parsing_axis)
-				mode[current_mode].axis[current_item].deadzone_size=x/2;
-		}
-		else if (!strcmp(line, "output_high"))
-		{
-			if (current_item == -1)
+			ring_size=atoi(argv[++i]);
+			continue;
+        } else if (!strcmp(argv[i], "-replay-speed")) {
+			if(i+2>argc)
 			{
-				printf("Error parsing output_high: no axis or button given");
+				puts("Not enough arguments to -replay-speed");
 				exit(1);
 			}
-			if (parsing_axis==0)
-				printf("output_high has no meaning for a button");
-			fscanf(file, " = %d ", &x);
-			if (parsing_axis)
-				mode[current_mode].axis[current_item].output_high=x;
-		}
-		else if (!strcmp(line, "output_low"))
-		{
-			if (current_item == -1)
+			replay_speed = atof(argv[++i]);
+			if (replay_speed < 0)
+				replay_speed = 0;
+			continue;
+        } else if (!strcmp(argv[i], "-bench-exec")) {
+			if(i+2>argc) 
 			{
-				printf("Error parsing output_low: no axis or button given");
+				puts("Not enough arguments to -bench-exec");
 				exit(1);
 			}
-			if (parsing_axis==0)
-				printf("output_low has no meaning for a button");
-			fscanf(file, " = %d ", &x);
-			if (parsing_axis)
-				mode[current_mode].axis[current_item].output_low=x;
-		}
-		else if (!strcmp(line, "repeat"))
-		{
-			if (current_item == -1)
+			bench_exec=atoi(argv[++i]);
+			continue;
+        } else if (!strcmp(argv[i], "-rt-priority")) {
+			if(i+2>argc)
 			{
-				printf("Error parsing output_low: no axis or button given");
+				puts("Not enough arguments to -rt-priority");
 				exit(1);
 			}
-			if (parsing_axis==0)
-				printf("repeat has no meaning for a button");
-			fscanf(file, " = %d ", &x);
-			if (parsing_axis)
-				mode[current_mode].axis[current_item].repeat=x;
-        } 
-        else if (!strcmp(line, "#"))
-        {
-            fgets(line, 1024, file);
-            /* Comment */
-		} 
-        else if (strlen(line)) {
-            printf("Unrecognized option: %s\n", line);
-        }
-        *line = '\0';
-    }	    
-	fclose(file);
-}
-
-
-void process_args(int argc, char **argv)
-{
-    int i;
-
-    if(!argv[1]) return;
-    for(i=(argc == 1 || argv[1][0] == '-') ? 1 : 2; i<argc; i++)
-    {
-		if(!strcmp(argv[i], "-dev"))
-		{
-			if(i+2>argc) 
+			rt_priority=atoi(argv[++i]);
+			continue;
+        } else if (!strcmp(argv[i], "-cpu")) {
+			if(i+2>argc)
 			{
-				puts("Not enough arguments to -dev");
+				puts("Not enough arguments to -cpu");
 				exit(1);
 			}
-			device=strdup(argv[++i]);
+			rt_cpu=atoi(argv[++i]);
+			continue;
+        } else if (!strcmp(argv[i], "-lock-memory")) {
+			rt_lock_memory=1;
+			continue;
+        } else if (!strcmp(argv[i], "-rt-test")) {
+			if(i+2>argc)
+			{
+				puts("Not enough arguments to -rt-test");
+				exit(1);
+			}
+			rt_test=atoi(argv[++i]);
 			continue;
-		} else if (!strcmp(argv[i], "--no-daemon")) {
-            daemonize = 0;
         }
 
 		printf("Unknown option %s\n", argv[i]);
 		puts("Usage: joy2script [\"Window Name\"]");
-		printf("\n       [ -dev {%s} ]", DEFAULT_DEVICE);
+		printf("\n       [ -dev {%s} ] ...", DEFAULT_DEVICE);
+		printf("\n       [ -evdev ]");
 		printf("\n       [ -config {%s} ]", DEFAULT_CONFIG_FILE);
 		printf("\n       [ --no-daemon ]");
+		printf("\n       [ -workers {%d} ]", DEFAULT_WORKERS);
+		printf("\n       [ -max-children {%d} ]", DEFAULT_MAX_CHILDREN);
+		printf("\n       [ -max-queued {%d} ]", DEFAULT_MAX_QUEUED);
+		printf("\n       [ -stream (json|binary) ]");
+		printf("\n       [ -stream-socket (path) ]");
+		printf("\n       [ -control (path) ]");
+		printf("\n       [ -record (file) ]");
+		printf("\n       [ -replay (file) ]");
+		printf("\n       [ -replay-speed {1} ]");
+		printf("\n       [ -ring-size {%d} ]", DEFAULT_RING_SIZE);
+		printf("\n       [ -no-cache ]");
+		printf("\n       [ -bench-exec (count) ]");
+		printf("\n       [ -rt-priority (1-99) ]");
+		printf("\n       [ -cpu (number) ]");
+		printf("\n       [ -lock-memory ]");
+		printf("\n       [ -rt-test (count) ]");
 
 		puts("\n\nnote: [] denotes `optional' option or argument,");
 		puts("      () hints at the wanted arguments for options");